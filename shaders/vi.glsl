@@ -0,0 +1,15 @@
+#version 330
+
+layout(location = 0) in vec3 p0;		// Vertex matrix P, column 0
+layout(location = 1) in vec3 p1;		// Vertex matrix P, column 1
+layout(location = 2) in vec3 p2;		// Vertex matrix P, column 2
+layout(location = 3) in vec3 start;		// Per-instance start position
+layout(location = 4) in vec3 heading;	// Per-instance heading
+
+uniform mat4 xform;			// World-to-clip transform matrix
+
+void main() {
+	// Place the block vertex in this copy's frame, then output clip-space position
+	vec3 pos = start + mat3(p0, p1, p2) * heading;
+	gl_Position = xform * vec4(pos, 1.0);
+}
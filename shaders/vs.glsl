@@ -0,0 +1,13 @@
+#version 330
+
+layout(location = 0) in ivec2 start;	// Per-instance start, lattice coordinates
+layout(location = 1) in uvec2 dirRun;	// Per-instance direction index and run length
+
+uniform mat4 xform;			// Lattice-to-clip transform matrix
+uniform vec2 units[6];		// Unit step of each lattice direction
+
+void main() {
+	// Vertex 0 is the start, vertex 1 is run steps along the direction
+	vec2 pos = vec2(start) + float(dirRun.y * uint(gl_VertexID)) * units[dirRun.x];
+	gl_Position = xform * vec4(pos, 0.0, 1.0);
+}
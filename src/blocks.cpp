@@ -0,0 +1,231 @@
+#include "blocks.hpp"
+#include "turtle.hpp"
+#include <utility>
+#include <algorithm>
+
+// Largest subtree, in vertices, that is kept as a block
+static const uint64_t MAX_BLOCK = 1 << 14;
+// Symbols walked and vertices copied between asking whether to cancel
+static const uint64_t CANCEL_CHECK = 1 << 20;
+
+// Empty cache
+BlockCache::BlockCache() :
+	valid(false),
+	worked(0),
+	stopped(false) {}
+
+// Cache for the given rules; blocks are built as they are needed
+BlockCache::BlockCache(const RuleTable& rules, float angle) :
+	rules(rules),
+	valid(rules.isBalanced()),
+	worked(0),
+	stopped(false) {
+
+	for (unsigned int ch = 0; ch < 256; ch++)
+		rotations[ch] = Turtle::rotation((char)ch, angle);
+}
+
+// Geometry of a whole iteration
+std::vector<glm::vec3> BlockCache::geometry(const std::string& axiom, unsigned int depth,
+	const Cancel& cancel) {
+
+	this->cancel = cancel;
+	worked = 0;
+	stopped = false;
+	uint64_t total = 0;
+	for (char ch : axiom)
+		total += count(ch, depth);
+
+	std::vector<glm::vec3> verts;
+	verts.reserve(total);
+	glm::vec3 pos(0.0f, 0.0f, 0.0f);
+	glm::vec3 dir(0.0f, 1.0f, 0.0f);
+	assemble(axiom.data(), axiom.size(), depth, pos, dir, verts);
+	if (stopped)
+		verts.clear();
+	return verts;
+}
+
+// Vertex count below a symbol, memoized per (symbol, depth)
+uint64_t BlockCache::count(char ch, unsigned int depth) {
+	if (!rules.hasRule(ch) || depth == 0)
+		return Turtle::draws(ch) ? 2 : 0;
+
+	uint64_t key = ((uint64_t)depth << 8) | (unsigned char)ch;
+	auto found = counts.find(key);
+	if (found != counts.end())
+		return found->second;
+
+	uint64_t total = 0;
+	const char* img = rules.image(ch);
+	for (size_t i = 0; i < rules.length(ch); i++)
+		total += count(img[i], depth - 1);
+	counts[key] = total;
+	return total;
+}
+
+// Cancelling is checked rarely, since blocks are copied in tight loops
+bool BlockCache::stopping(uint64_t work) {
+	worked += work;
+	if (worked >= CANCEL_CHECK) {
+		worked = 0;
+		stopped = stopped || (cancel && cancel());
+	}
+	return stopped;
+}
+
+// Build the block of a symbol from the blocks one level down
+const BlockCache::Block& BlockCache::block(char ch, unsigned int depth) {
+	uint64_t key = ((uint64_t)depth << 8) | (unsigned char)ch;
+	auto found = blocks.find(key);
+	if (found != blocks.end())
+		return found->second;
+
+	// Walk the rule image with the frame-relative state (move, turn)
+	Block b;
+	b.verts.reserve(count(ch, depth));
+	b.move = glm::mat3(0.0f);
+	b.turn = glm::mat3(1.0f);
+	std::vector<std::pair<glm::mat3, glm::mat3>> stack;
+	const char* img = rules.image(ch);
+	for (size_t i = 0; i < rules.length(ch); i++) {
+		char c = img[i];
+		if (c == '[')
+			stack.emplace_back(b.move, b.turn);
+		else if (c == ']') {
+			b.move = stack.back().first;
+			b.turn = stack.back().second;
+			stack.pop_back();
+		} else if (rules.hasRule(c) && depth > 1) {
+			// Child vertices P become move + P * turn in this frame
+			const Block& child = block(c, depth - 1);
+			for (auto& p : child.verts)
+				b.verts.push_back(b.move + p * b.turn);
+			b.move += child.move * b.turn;
+			b.turn = child.turn * b.turn;
+		} else {
+			if (Turtle::draws(c))
+				b.verts.push_back(b.move);
+			if (Turtle::moves(c))
+				b.move += b.turn;
+			if (Turtle::draws(c))
+				b.verts.push_back(b.move);
+			b.turn = rotations[(unsigned char)c] * b.turn;
+		}
+	}
+	return blocks.emplace(key, std::move(b)).first->second;
+}
+
+// Interpret symbols at the given depth, emitting small subtrees from their
+// blocks and descending into large ones
+void BlockCache::assemble(const char* str, size_t len, unsigned int depth,
+	glm::vec3& pos, glm::vec3& dir, std::vector<glm::vec3>& out) {
+
+	std::vector<std::pair<glm::vec3, glm::vec3>> stack;
+	for (size_t i = 0; i < len && !stopping(1); i++) {
+		char ch = str[i];
+		if (ch == '[')
+			stack.emplace_back(pos, dir);
+		else if (ch == ']') {
+			if (!stack.empty()) {
+				pos = stack.back().first;
+				dir = stack.back().second;
+				stack.pop_back();
+			}
+		} else if (!rules.hasRule(ch) || depth == 0) {
+			// A single turtle operation
+			if (Turtle::draws(ch))
+				out.push_back(pos);
+			if (Turtle::moves(ch))
+				pos += dir;
+			if (Turtle::draws(ch))
+				out.push_back(pos);
+			dir = rotations[(unsigned char)ch] * dir;
+		} else if (count(ch, depth) <= MAX_BLOCK) {
+			// Transform a copy of the cached block
+			const Block& b = block(ch, depth);
+			for (auto& p : b.verts)
+				out.push_back(pos + p * dir);
+			pos += b.move * dir;
+			dir = b.turn * dir;
+			stopping(b.verts.size());
+		} else
+			assemble(rules.image(ch), rules.length(ch), depth - 1, pos, dir, out);
+	}
+}
+
+// Split an iteration into copies of the blocks level steps above it
+BlockCache::Instances BlockCache::instances(const std::string& axiom,
+	unsigned int depth, unsigned int level, const Cancel& cancel) {
+
+	this->cancel = cancel;
+	worked = 0;
+	stopped = false;
+	level = std::min(level, depth);
+	std::map<uint64_t, std::vector<glm::vec3>> frames;
+	glm::vec3 pos(0.0f, 0.0f, 0.0f);
+	glm::vec3 dir(0.0f, 1.0f, 0.0f);
+	place(axiom.data(), axiom.size(), depth, level, pos, dir, frames);
+	if (stopped)
+		return Instances();
+
+	// Lay out the blocks and their frames back to back, one group each
+	Instances ret;
+	for (auto& f : frames) {
+		Instances::Group g;
+		g.firstVert = ret.verts.size();
+		g.firstFrame = ret.frames.size() / 2;
+		g.numFrames = f.second.size() / 2;
+		if (f.first == 0) {
+			// A single segment, P = 0 to P = I
+			ret.verts.push_back(glm::mat3(0.0f));
+			ret.verts.push_back(glm::mat3(1.0f));
+		} else {
+			const Block& b = block((char)(f.first & 0xFF), level);
+			ret.verts.insert(ret.verts.end(), b.verts.begin(), b.verts.end());
+		}
+		g.numVerts = ret.verts.size() - g.firstVert;
+		ret.frames.insert(ret.frames.end(), f.second.begin(), f.second.end());
+		ret.groups.push_back(g);
+	}
+	return ret;
+}
+
+// Walk down to the blocks level steps deep, recording where each one starts;
+// drawn symbols without rules share the segment block under key 0
+void BlockCache::place(const char* str, size_t len, unsigned int depth, unsigned int level,
+	glm::vec3& pos, glm::vec3& dir, std::map<uint64_t, std::vector<glm::vec3>>& frames) {
+
+	std::vector<std::pair<glm::vec3, glm::vec3>> stack;
+	for (size_t i = 0; i < len && !stopping(1); i++) {
+		char ch = str[i];
+		if (ch == '[')
+			stack.emplace_back(pos, dir);
+		else if (ch == ']') {
+			if (!stack.empty()) {
+				pos = stack.back().first;
+				dir = stack.back().second;
+				stack.pop_back();
+			}
+		} else if (!rules.hasRule(ch) || depth == 0) {
+			if (Turtle::draws(ch)) {
+				auto& f = frames[0];
+				f.push_back(pos);
+				f.push_back(dir);
+			}
+			if (Turtle::moves(ch))
+				pos += dir;
+			dir = rotations[(unsigned char)ch] * dir;
+		} else if (depth == level) {
+			const Block& b = block(ch, depth);
+			if (!b.verts.empty()) {
+				auto& f = frames[((uint64_t)depth << 8) | (unsigned char)ch];
+				f.push_back(pos);
+				f.push_back(dir);
+			}
+			pos += b.move * dir;
+			dir = b.turn * dir;
+		} else
+			place(rules.image(ch), rules.length(ch), depth - 1, level, pos, dir, frames);
+	}
+}
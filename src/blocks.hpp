@@ -0,0 +1,87 @@
+#ifndef BLOCKS_HPP
+#define BLOCKS_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <functional>
+#include <glm/glm.hpp>
+#include "rules.hpp"
+
+// Memoized subtree geometry for the turtle interpreter
+// The vertices a bracket-balanced subtree emits are p + P * d for start
+// position p and heading d (see Motion), so the matrices P of every
+// (symbol, depth) expansion are computed once, in the subtree's own frame,
+// and each copy of the subtree is emitted with one matrix-vector product
+// per vertex instead of re-running the turtle over its symbols
+class BlockCache {
+public:
+	BlockCache();
+	BlockCache(const RuleTable& rules, float angle);
+
+	// Whether every rule is bracket-balanced, which blocks require
+	bool isValid() const {
+		return valid; }
+
+	// Asked now and then during long walks; true gives up the walk
+	typedef std::function<bool()> Cancel;
+
+	// Geometry of the given symbols after depth more steps, assembled from
+	// cached blocks; matches Turtle within float tolerance
+	// Empty if cancel gave up the walk
+	std::vector<glm::vec3> geometry(const std::string& axiom, unsigned int depth,
+		const Cancel& cancel = Cancel());
+
+	// Geometry of an iteration as the distinct blocks level steps deep and the
+	// frames they are drawn at; vertex v of a copy at (pos, dir) is pos + P * dir
+	struct Instances {
+		// Copies of one block
+		struct Group {
+			uint32_t firstVert;		// First vertex matrix of the block
+			uint32_t numVerts;		// Vertex matrices in the block
+			uint32_t firstFrame;	// First (pos, dir) pair of its copies
+			uint32_t numFrames;		// Number of copies
+		};
+		std::vector<glm::mat3> verts;	// Vertex matrices of every block
+		std::vector<glm::vec3> frames;	// Start position and heading of every copy
+		std::vector<Group> groups;		// One per distinct block
+	};
+	// Empty if cancel gave up the walk
+	Instances instances(const std::string& axiom, unsigned int depth, unsigned int level,
+		const Cancel& cancel = Cancel());
+
+	// Number of vertices emitted below a symbol
+	uint64_t count(char ch, unsigned int depth);
+
+private:
+	// Vertices of one subtree in its own frame
+	struct Block {
+		std::vector<glm::mat3> verts;	// Vertex matrices P
+		glm::mat3 move;					// Displacement matrix
+		glm::mat3 turn;					// Heading matrix
+	};
+
+	// Block of a symbol that has a rule, built from its children's blocks
+	const Block& block(char ch, unsigned int depth);
+	// Count work done, asking cancel every CANCEL_CHECK units; true once
+	// the walk is given up
+	bool stopping(uint64_t work);
+	// Emit the geometry of a symbol sequence into out
+	void assemble(const char* str, size_t len, unsigned int depth,
+		glm::vec3& pos, glm::vec3& dir, std::vector<glm::vec3>& out);
+	// Record the frame of every block level steps deep below a symbol sequence
+	void place(const char* str, size_t len, unsigned int depth, unsigned int level,
+		glm::vec3& pos, glm::vec3& dir, std::map<uint64_t, std::vector<glm::vec3>>& frames);
+
+	RuleTable rules;							// Rules applied at every step
+	glm::mat3 rotations[256];					// Heading rotation of each symbol
+	bool valid;									// All rules are balanced
+	std::unordered_map<uint64_t, uint64_t> counts;	// (symbol, depth) -> vertices
+	std::unordered_map<uint64_t, Block> blocks;	// (symbol, depth) -> block
+	Cancel cancel;								// Cancel of the current walk
+	uint64_t worked;							// Work since cancel was last asked
+	bool stopped;								// The current walk was given up
+};
+
+#endif
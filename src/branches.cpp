@@ -0,0 +1,227 @@
+#include "branches.hpp"
+#include <thread>
+#include <algorithm>
+
+// Branches that expand to fewer symbols than this are walked in place
+static const uint64_t MIN_TASK = 1 << 12;
+// Symbols each thread walks between asking whether to cancel
+static const uint64_t CANCEL_CHECK = 1 << 20;
+
+// Product that saturates at UINT64_MAX
+static uint64_t satMul(uint64_t a, uint64_t b) {
+	return (a && b > UINT64_MAX / a) ? UINT64_MAX : a * b;
+}
+
+// Distance from every '[' in a string to its matching ']'; false if the
+// string is not balanced
+static bool matchBrackets(const char* str, size_t len, std::vector<uint32_t>& close) {
+	close.assign(len, 0);
+	std::vector<uint32_t> open;
+	for (size_t i = 0; i < len; i++) {
+		if (str[i] == '[')
+			open.push_back((uint32_t)i);
+		else if (str[i] == ']') {
+			if (open.empty())
+				return false;
+			close[open.back()] = (uint32_t)i - open.back();
+			open.pop_back();
+		}
+	}
+	return open.empty();
+}
+
+// Empty engine
+BranchEngine::BranchEngine() :
+	valid(false),
+	minSpawn(0) {}
+
+// Engine for the given grammar
+BranchEngine::BranchEngine(const std::string& axiom, const RuleTable& rules,
+	const Turtle::Table& table) :
+	axiom(axiom),
+	rules(rules),
+	table(table),
+	valid(true),
+	minSpawn(0) {
+
+	bool branches = false;
+	valid = matchBrackets(axiom.data(), axiom.size(), axiomClose);
+	for (unsigned int ch = 0; ch < 256 && valid; ch++) {
+		if (!rules.hasRule((char)ch))
+			continue;
+		const char* img = rules.image((char)ch);
+		size_t len = rules.length((char)ch);
+		valid = matchBrackets(img, len, ruleClose[ch]);
+		branches = branches || std::find(img, img + len, '[') != img + len;
+	}
+	valid = valid && branches;
+}
+
+// Spawn the axiom as the first task and let every thread work until the
+// pool runs dry, then join the per-thread buffers
+std::vector<glm::vec3> BranchEngine::geometry(unsigned int iter, unsigned int threads,
+	const Cancel& cancel) {
+
+	// Expanded length of every symbol at each depth, read by all threads
+	while (lengths.size() <= iter) {
+		std::array<uint64_t, 256> len;
+		for (unsigned int ch = 0; ch < 256; ch++) {
+			if (lengths.empty() || !rules.hasRule((char)ch)) {
+				len[ch] = 1;
+				continue;
+			}
+			uint64_t total = 0;
+			const char* img = rules.image((char)ch);
+			for (size_t i = 0; i < rules.length((char)ch); i++) {
+				uint64_t l = lengths.back()[(unsigned char)img[i]];
+				total = (total + l < total) ? UINT64_MAX : total + l;
+			}
+			len[ch] = total;
+		}
+		lengths.push_back(len);
+	}
+
+	// Below this depth no branch in the axiom or a rule image is big enough
+	// to spawn, so branch sizes are not even measured
+	size_t longest = axiom.size();
+	for (unsigned int ch = 0; ch < 256; ch++)
+		longest = std::max(longest, rules.length((char)ch));
+	minSpawn = 0;
+	while (minSpawn < lengths.size() &&
+		satMul(*std::max_element(lengths[minSpawn].begin(), lengths[minSpawn].end()), longest) < MIN_TASK)
+		minSpawn++;
+
+	threads = std::max(1u, threads);
+	Pool pool;
+	pool.workers = std::vector<Worker>(threads);
+	pool.pending = 1;
+	pool.stopped = false;
+	pool.cancel = &cancel;
+	State start{ glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f) };
+	pool.workers[0].tasks.push_back({ axiom.data(), axiomClose.data(), axiom.size(), iter, start });
+
+	std::vector<std::thread> threadList;
+	for (size_t t = 1; t < threads; t++)
+		threadList.emplace_back([this, &pool, t]() { work(pool, t); });
+	work(pool, 0);
+	for (auto& t : threadList) t.join();
+	threadList.clear();
+	if (pool.stopped)
+		return {};
+
+	// Join the buffers: the largest becomes the result, and every other
+	// thread copies its own onto the end
+	size_t largest = 0;
+	for (size_t t = 1; t < threads; t++)
+		if (pool.workers[t].verts.size() > pool.workers[largest].verts.size())
+			largest = t;
+	std::vector<glm::vec3> verts = std::move(pool.workers[largest].verts);
+	std::vector<size_t> offset(threads + 1, 0);
+	offset[0] = verts.size();
+	for (size_t t = 0; t < threads; t++)
+		offset[t + 1] = offset[t] + pool.workers[t].verts.size();
+	verts.resize(offset[threads]);
+	for (size_t t = 0; t < threads; t++)
+		if (!pool.workers[t].verts.empty())
+			threadList.emplace_back([&, t]() {
+				auto& src = pool.workers[t].verts;
+				std::copy(src.begin(), src.end(), verts.begin() + offset[t]);
+			});
+	for (auto& t : threadList) t.join();
+
+	return verts;
+}
+
+// Take tasks from our own deque, or steal from another thread's
+void BranchEngine::work(Pool& pool, size_t self) const {
+	size_t victim = self;
+	while (pool.pending > 0 && !pool.stopped) {
+		Task task;
+		bool found = false;
+		{
+			Worker& w = pool.workers[self];
+			std::lock_guard<std::mutex> guard(w.lock);
+			if (!w.tasks.empty()) {
+				task = w.tasks.back();
+				w.tasks.pop_back();
+				found = true;
+			}
+		}
+		for (size_t i = 1; i < pool.workers.size() && !found; i++) {
+			victim = (victim + 1) % pool.workers.size();
+			if (victim == self)
+				continue;
+			Worker& w = pool.workers[victim];
+			std::lock_guard<std::mutex> guard(w.lock);
+			if (!w.tasks.empty()) {
+				task = w.tasks.front();
+				w.tasks.pop_front();
+				found = true;
+			}
+		}
+		if (!found) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		State state = task.state;
+		walk(task, state, pool, self);
+		pool.pending--;
+	}
+}
+
+// Expand rules depth-first, drawing as the turtle would; a branch that is
+// big enough becomes a task of its own and is skipped here
+void BranchEngine::walk(const Task& task, State& state, Pool& pool, size_t self) const {
+	Worker& w = pool.workers[self];
+	std::vector<glm::vec3>& verts = w.verts;
+	const auto& len = lengths[task.depth];
+	for (size_t i = 0; i < task.len; i++) {
+		if (++w.walked >= CANCEL_CHECK) {
+			w.walked = 0;
+			if (pool.stopped || (*pool.cancel && (*pool.cancel)()))
+				w.stopped = pool.stopped = true;
+		}
+		if (w.stopped)
+			return;
+		unsigned char ch = task.str[i];
+		if (ch == '[') {
+			size_t end = i + task.close[i];
+			uint64_t size = 0;
+			if (task.depth >= minSpawn)
+				for (size_t j = i + 1; j < end && size < MIN_TASK; j++)
+					size += len[(unsigned char)task.str[j]];
+
+			if (size >= MIN_TASK) {
+				pool.pending++;
+				std::lock_guard<std::mutex> guard(w.lock);
+				w.tasks.push_back({ task.str + i + 1, task.close + i + 1, end - i - 1, task.depth, state });
+				i = end;
+			} else
+				w.stack.push_back(state);
+
+		} else if (ch == ']') {
+			state = w.stack.back();
+			w.stack.pop_back();
+
+		} else if (task.depth > 0 && rules.hasRule(ch)) {
+			walk({ rules.image(ch), ruleClose[ch].data(), rules.length(ch), task.depth - 1, state },
+				state, pool, self);
+
+		} else switch (table.ops[ch]) {
+		case Turtle::Table::DRAW:
+			verts.push_back(state.pos);
+			state.pos += state.dir;
+			verts.push_back(state.pos);
+			break;
+		case Turtle::Table::MOVE:
+			state.pos += state.dir;
+			break;
+		case Turtle::Table::TURN:
+			state.dir = table.rotations[ch] * state.dir;
+			break;
+		default:
+			break;
+		}
+	}
+}
@@ -0,0 +1,89 @@
+#ifndef BRANCHES_HPP
+#define BRANCHES_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <array>
+#include <functional>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "rules.hpp"
+#include "turtle.hpp"
+
+// Derives and interprets an iteration in one recursive walk, never building
+// its string
+// A bracketed subtree only needs the turtle state at its '[' to be drawn,
+// and the state after its ']' is the state before it, so large subtrees are
+// handed to a work-stealing pool while the walk carries on past them. Each
+// thread draws into its own buffer; the buffers are joined at the end.
+class BranchEngine {
+public:
+	BranchEngine();
+	BranchEngine(const std::string& axiom, const RuleTable& rules, const Turtle::Table& table);
+
+	// Whether the axiom and every rule are bracket-balanced, and the rules
+	// branch at all, which the engine needs to be of any use
+	bool isValid() const {
+		return valid; }
+
+	// Asked now and then by every thread; true gives up the walk
+	typedef std::function<bool()> Cancel;
+
+	// Geometry of iteration N using the given number of threads; the same
+	// segments as Turtle, in a different order
+	// Empty if cancel gave up the walk
+	std::vector<glm::vec3> geometry(unsigned int iter, unsigned int threads,
+		const Cancel& cancel = Cancel());
+
+private:
+	// Turtle position and heading
+	struct State {
+		glm::vec3 pos;
+		glm::vec3 dir;
+	};
+	// Symbols str[0, len) expanded depth more times, drawn from state;
+	// close[i] is the distance from a '[' at str[i] to its ']'
+	struct Task {
+		const char* str;
+		const uint32_t* close;
+		size_t len;
+		unsigned int depth;
+		State state;				// Start state, for spawned tasks
+	};
+	// A thread's task deque and vertices; the owner works at the back,
+	// thieves take from the front, where the oldest (largest) tasks are
+	struct Worker {
+		std::mutex lock;
+		std::deque<Task> tasks;
+		std::vector<glm::vec3> verts;
+		std::vector<State> stack;		// States saved at branches walked in place
+		uint64_t walked = 0;			// Symbols since cancel was last asked
+		bool stopped = false;			// This thread has seen the walk given up
+	};
+	// Threads working on one iteration
+	struct Pool {
+		std::vector<Worker> workers;	// One per thread
+		std::atomic<uint64_t> pending;	// Tasks spawned but not finished
+		std::atomic<bool> stopped;		// The walk was given up
+		const Cancel* cancel;			// Asked every CANCEL_CHECK symbols
+	};
+
+	// Run tasks until every task is done
+	void work(Pool& pool, size_t self) const;
+	// Interpret a symbol sequence, spawning its large branches
+	void walk(const Task& task, State& state, Pool& pool, size_t self) const;
+
+	std::string axiom;							// Iteration 0
+	RuleTable rules;							// Rules applied at every step
+	Turtle::Table table;						// Turtle opcodes and rotations
+	bool valid;									// Balanced and branching
+	std::vector<uint32_t> axiomClose;			// Bracket distances in the axiom
+	std::vector<uint32_t> ruleClose[256];		// Bracket distances in each rule image
+	std::vector<std::array<uint64_t, 256>> lengths;	// Expanded length per depth
+	unsigned int minSpawn;						// Shallowest depth that may spawn
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include "derivation.hpp"
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+// Symbols are handed to the sink in blocks of this size
+static const size_t BLOCK_SIZE = 1 << 14;
+// Bracket depths are clamped here so unbalanced grammars cannot overflow;
+// no buildable iteration comes close
+static const int64_t MAX_NESTING = (int64_t)1 << 48;
+
+// Empty derivation
+Derivation::Derivation() {}
+
+// Derivation of the given axiom under the given rules, starting with
+// iteration 0 only
+Derivation::Derivation(const std::string& axiom, const RuleTable& rules) :
+	axiom(axiom),
+	rules(rules) {
+	grow(0);
+}
+
+// Add a root node for every iteration up to N
+void Derivation::grow(unsigned int iter) {
+	while (roots.size() <= iter) {
+		unsigned int depth = roots.size();
+		// The root's children are the axiom's symbols at the iteration's depth
+		roots.push_back(makeNode('\0', depth + 1, axiom.data(), axiom.size()));
+		nodes[roots.back()].depth = depth;
+	}
+}
+
+// Find or create the node for symbol c at depth d
+uint32_t Derivation::node(char c, unsigned int d) {
+	// Symbols without rules never change, so they share one terminal node
+	if (!rules.hasRule(c))
+		d = 0;
+	uint64_t key = ((uint64_t)d << 8) | (unsigned char)c;
+	auto found = index.find(key);
+	if (found != index.end())
+		return found->second;
+
+	uint32_t id;
+	if (d == 0) {
+		id = (uint32_t)nodes.size();
+		int64_t nest = c == '[' ? 1 : c == ']' ? -1 : 0;
+		nodes.push_back({ c, 0, 1, (uint32_t)children.size(), 0, nest, std::max<int64_t>(nest, 0) });
+	} else
+		id = makeNode(c, d, rules.image(c), rules.length(c));
+	index[key] = id;
+	return id;
+}
+
+// Create a node whose children are the given symbols at depth d - 1
+uint32_t Derivation::makeNode(char c, unsigned int d, const char* str, size_t len) {
+	std::vector<uint32_t> kids(len);
+	uint64_t total = 0;
+	int64_t nest = 0, peak = 0;
+	for (size_t i = 0; i < len; i++) {
+		kids[i] = node(str[i], d - 1);
+		const Node& kid = nodes[kids[i]];
+		total = (total + kid.length < total) ? UINT64_MAX : total + kid.length;
+		peak = std::max(peak, std::min(nest + kid.peak, MAX_NESTING));
+		nest = std::max(std::min(nest + kid.nest, MAX_NESTING), -MAX_NESTING);
+	}
+
+	uint32_t id = (uint32_t)nodes.size();
+	nodes.push_back({ c, d, total, (uint32_t)children.size(), (uint32_t)len, nest, peak });
+	children.insert(children.end(), kids.begin(), kids.end());
+	return id;
+}
+
+// Depth-first walk of the DAG below the root of iteration N
+// Subtrees that end before begin are skipped whole using their lengths
+void Derivation::stream(unsigned int iter, const Sink& sink,
+	uint64_t begin, uint64_t end) const {
+	// Remaining children of a node being expanded
+	struct Cursor {
+		const uint32_t* next;
+		const uint32_t* end;
+	};
+	const Node& root = nodes[roots.at(iter)];
+	if (end > root.length)
+		end = root.length;
+	if (begin >= end)
+		return;
+	uint64_t remaining = end - begin;
+
+	std::vector<Cursor> stack;
+	stack.reserve(iter + 1);
+	stack.push_back({ children.data() + root.first, children.data() + root.first + root.count });
+
+	char block[BLOCK_SIZE];
+	size_t fill = 0;
+	// Append symbols to the output block, flushing when it is full
+	// Returns false once the end of the range has been reached
+	auto emit = [&](const char* str, size_t len) {
+		if (len > remaining)
+			len = (size_t)remaining;
+		remaining -= len;
+		while (len) {
+			size_t n = std::min(len, BLOCK_SIZE - fill);
+			memcpy(block + fill, str, n);
+			fill += n;
+			str += n;
+			len -= n;
+			if (fill == BLOCK_SIZE) {
+				sink(block, fill);
+				fill = 0;
+			}
+		}
+		return remaining > 0;
+	};
+
+	// Descend to the node containing begin
+	uint64_t skip = begin;
+	while (skip && !stack.empty()) {
+		Cursor& c = stack.back();
+		if (c.next == c.end) {
+			stack.pop_back();
+			continue;
+		}
+		const Node& n = nodes[*c.next++];
+		if (n.length <= skip)
+			skip -= n.length;
+		else if (n.depth == 1) {
+			emit(rules.image(n.symbol) + skip, rules.length(n.symbol) - (size_t)skip);
+			skip = 0;
+		} else
+			stack.push_back({ children.data() + n.first, children.data() + n.first + n.count });
+	}
+
+	bool more = remaining > 0;
+	while (more && !stack.empty()) {
+		Cursor& c = stack.back();
+		// Done with this node
+		if (c.next == c.end) {
+			stack.pop_back();
+			continue;
+		}
+
+		const Node& n = nodes[*c.next++];
+		if (n.depth == 0)
+			more = emit(&n.symbol, 1);
+		else if (n.depth == 1)
+			// Children are all terminals, so the expansion is the rule image
+			more = emit(rules.image(n.symbol), rules.length(n.symbol));
+		else
+			stack.push_back({ children.data() + n.first, children.data() + n.first + n.count });
+	}
+
+	if (fill)
+		sink(block, fill);
+}
+
+// Build the full string of iteration N from the stream
+std::string Derivation::expand(unsigned int iter) const {
+	std::string ret;
+	ret.reserve(length(iter));
+	stream(iter, [&](const char* str, size_t len) { ret.append(str, len); });
+	return ret;
+}
+
+// Symbol at a given position of iteration N
+char Derivation::at(unsigned int iter, uint64_t pos) const {
+	if (pos >= length(iter))
+		throw std::out_of_range("position past the end of the iteration");
+	char ch = '\0';
+	stream(iter, [&](const char* str, size_t) { ch = str[0]; }, pos, pos + 1);
+	return ch;
+}
+
+// Symbols [begin, end) of iteration N
+std::string Derivation::substr(unsigned int iter, uint64_t begin, uint64_t end) const {
+	std::string ret;
+	stream(iter, [&](const char* str, size_t len) { ret.append(str, len); }, begin, end);
+	return ret;
+}
+
+// Bytes held by the DAG and its lookup index
+size_t Derivation::memoryUsage() const {
+	return nodes.capacity() * sizeof(Node) +
+		children.capacity() * sizeof(uint32_t) +
+		roots.capacity() * sizeof(uint32_t) +
+		index.size() * (sizeof(uint64_t) + sizeof(uint32_t) + 2 * sizeof(void*));
+}
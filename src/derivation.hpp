@@ -0,0 +1,77 @@
+#ifndef DERIVATION_HPP
+#define DERIVATION_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+#include "rules.hpp"
+
+// History of an L-system's iterations stored as a shared derivation DAG
+// Node (c, d) stands for the expansion of symbol c after d more steps and
+// points at the nodes of its rule image at depth d - 1. Nodes are
+// hash-consed, so the whole history costs O(iterations * total rule length)
+// no matter how long the strings get.
+class Derivation {
+public:
+	Derivation();
+	Derivation(const std::string& axiom, const RuleTable& rules);
+
+	// Add DAG levels until iteration N is available
+	void grow(unsigned int iter);
+	// Number of iterations available
+	unsigned int getNumIter() const {
+		return roots.size(); }
+
+	// Receives consecutive blocks of derived symbols
+	typedef std::function<void(const char*, size_t)> Sink;
+
+	// Feed symbols [begin, end) of iteration N to sink without building the
+	// string, using an explicit stack of at most N + 1 cursors into the DAG
+	void stream(unsigned int iter, const Sink& sink,
+		uint64_t begin = 0, uint64_t end = UINT64_MAX) const;
+	// Build the full string of iteration N
+	std::string expand(unsigned int iter) const;
+
+	// Random access into iteration N in O(N * rule length)
+	char at(unsigned int iter, uint64_t pos) const;
+	std::string substr(unsigned int iter, uint64_t begin, uint64_t end) const;
+
+	// Length of iteration N (saturates at UINT64_MAX)
+	uint64_t length(unsigned int iter) const {
+		return nodes[roots.at(iter)].length; }
+	// Deepest bracket nesting reached in iteration N
+	uint64_t maxNesting(unsigned int iter) const {
+		return (uint64_t)nodes[roots.at(iter)].peak; }
+	// Bytes held by the DAG
+	size_t memoryUsage() const;
+
+	const std::string& getAxiom() const {
+		return axiom; }
+
+private:
+	struct Node {
+		char symbol;		// Symbol this node expands ('\0' for roots)
+		unsigned int depth;	// Remaining derivation steps
+		uint64_t length;	// Length of the full expansion
+		uint32_t first;		// Children are children[first, first + count)
+		uint32_t count;
+		int64_t nest;		// Net change in bracket depth
+		int64_t peak;		// Deepest nesting relative to the start
+	};
+
+	// Find or create the node for symbol c at depth d
+	uint32_t node(char c, unsigned int d);
+	// Create a node whose children are the given symbols at depth d
+	uint32_t makeNode(char c, unsigned int d, const char* str, size_t len);
+
+	std::string axiom;							// Iteration 0
+	RuleTable rules;							// Rules applied at every step
+	std::vector<Node> nodes;					// Every distinct node
+	std::vector<uint32_t> children;				// Child lists of all nodes
+	std::unordered_map<uint64_t, uint32_t> index;	// (symbol, depth) -> node
+	std::vector<uint32_t> roots;				// Root node of each iteration
+};
+
+#endif
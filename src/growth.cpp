@@ -0,0 +1,132 @@
+#include "growth.hpp"
+#include <limits>
+#include <algorithm>
+
+// Saturating arithmetic
+static uint64_t satAdd(uint64_t a, uint64_t b) {
+	uint64_t r = a + b;
+	return (r < a) ? std::numeric_limits<uint64_t>::max() : r;
+}
+static uint64_t satMul(uint64_t a, uint64_t b) {
+	if (a && b > std::numeric_limits<uint64_t>::max() / a)
+		return std::numeric_limits<uint64_t>::max();
+	return a * b;
+}
+
+// Empty model: no symbols, every prediction is zero
+GrowthModel::GrowthModel() {}
+
+// Build the growth matrix over all symbols reachable from the axiom
+GrowthModel::GrowthModel(const std::string& axiom, const RuleTable& rules) {
+	// Find the alphabet by closing the axiom's symbols under the rules
+	int index[256];
+	std::fill(index, index + 256, -1);
+	for (size_t i = 0; i < axiom.size(); i++) {
+		unsigned char ch = axiom[i];
+		if (index[ch] < 0) {
+			index[ch] = (int)alphabet.size();
+			alphabet += (char)ch;
+		}
+	}
+	for (size_t i = 0; i < alphabet.size(); i++) {
+		const char* img = rules.image(alphabet[i]);
+		for (size_t k = 0; k < rules.length(alphabet[i]); k++) {
+			unsigned char ch = img[k];
+			if (index[ch] < 0) {
+				index[ch] = (int)alphabet.size();
+				alphabet += (char)ch;
+			}
+		}
+	}
+
+	size_t n = alphabet.size();
+	start.assign(n, 0);
+	for (unsigned char ch : axiom)
+		start[index[ch]]++;
+
+	growth.assign(n * n, 0);
+	for (size_t i = 0; i < n; i++) {
+		const char* img = rules.image(alphabet[i]);
+		for (size_t k = 0; k < rules.length(alphabet[i]); k++)
+			growth[i * n + index[(unsigned char)img[k]]]++;
+	}
+}
+
+// Symbol counts of iteration N by exponentiation by squaring
+std::vector<uint64_t> GrowthModel::counts(unsigned int iter) const {
+	std::vector<uint64_t> v = start;
+	Matrix base = growth;
+	while (iter) {
+		if (iter & 1)
+			v = step(v, base);
+		iter >>= 1;
+		if (iter)
+			base = multiply(base, base);
+	}
+	return v;
+}
+
+// Predict the sizes of iteration N
+GrowthModel::Prediction GrowthModel::predict(unsigned int iter) const {
+	return summarize(counts(iter));
+}
+
+// Step through iterations until the geometry exceeds the budget
+unsigned int GrowthModel::maxIteration(uint64_t budget, uint64_t bytesPerSegment,
+	unsigned int limit, bool cumulative) const {
+
+	std::vector<uint64_t> v = start;
+	uint64_t total = 0;
+	for (unsigned int iter = 0; ; iter++) {
+		uint64_t bytes = satMul(summarize(v).segments, bytesPerSegment);
+		total = cumulative ? satAdd(total, bytes) : bytes;
+		if (total > budget)
+			return iter ? iter - 1 : 0;
+		if (iter == limit)
+			return limit;
+		v = step(v, growth);
+	}
+}
+
+// Matrix-matrix product
+GrowthModel::Matrix GrowthModel::multiply(const Matrix& a, const Matrix& b) const {
+	size_t n = alphabet.size();
+	Matrix r(n * n, 0);
+	for (size_t i = 0; i < n; i++)
+		for (size_t k = 0; k < n; k++) {
+			uint64_t aik = a[i * n + k];
+			if (!aik) continue;
+			for (size_t j = 0; j < n; j++)
+				r[i * n + j] = satAdd(r[i * n + j], satMul(aik, b[k * n + j]));
+		}
+	return r;
+}
+
+// Row vector-matrix product
+std::vector<uint64_t> GrowthModel::step(const std::vector<uint64_t>& v, const Matrix& m) const {
+	size_t n = alphabet.size();
+	std::vector<uint64_t> r(n, 0);
+	for (size_t k = 0; k < n; k++) {
+		if (!v[k]) continue;
+		for (size_t j = 0; j < n; j++)
+			r[j] = satAdd(r[j], satMul(v[k], m[k * n + j]));
+	}
+	return r;
+}
+
+// Reduce symbol counts to string length, segments and moves
+GrowthModel::Prediction GrowthModel::summarize(const std::vector<uint64_t>& counts) const {
+	Prediction p = { 0, 0, 0 };
+	for (size_t i = 0; i < alphabet.size(); i++) {
+		p.length = satAdd(p.length, counts[i]);
+		switch (alphabet[i]) {
+		case 'f': case 'F': case 'g': case 'G':
+			p.segments = satAdd(p.segments, counts[i]);
+			break;
+		case 's': case 'S':
+			p.moves = satAdd(p.moves, counts[i]);
+			break;
+		}
+	}
+	return p;
+}
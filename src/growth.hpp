@@ -0,0 +1,50 @@
+#ifndef GROWTH_HPP
+#define GROWTH_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "rules.hpp"
+
+// Predicts the size of any iteration of an L-system from its growth matrix
+// Entry (i, j) of the matrix counts symbol j in the rule image of symbol i,
+// so the symbol counts of iteration N are the axiom's counts times M^N
+// All counts saturate at UINT64_MAX instead of overflowing
+class GrowthModel {
+public:
+	GrowthModel();
+	GrowthModel(const std::string& axiom, const RuleTable& rules);
+
+	// Sizes of a single iteration
+	struct Prediction {
+		uint64_t length;	// Length of the string
+		uint64_t segments;	// Drawn segments ('f' and 'g')
+		uint64_t moves;		// Undrawn moves ('s')
+	};
+	// Predict iteration N in O(|alphabet|^3 log N)
+	Prediction predict(unsigned int iter) const;
+	// Count of every symbol in iteration N, indexed by getAlphabet()
+	std::vector<uint64_t> counts(unsigned int iter) const;
+
+	// Last iteration N such that the geometry of each iteration up to N, at
+	// bytesPerSegment each, fits in budget; if cumulative, the geometry of all
+	// of them together must fit (searches at most limit iterations)
+	unsigned int maxIteration(uint64_t budget, uint64_t bytesPerSegment,
+		unsigned int limit, bool cumulative) const;
+
+	const std::string& getAlphabet() const {
+		return alphabet; }
+
+private:
+	typedef std::vector<uint64_t> Matrix;	// Row-major, n x n
+
+	Matrix multiply(const Matrix& a, const Matrix& b) const;
+	std::vector<uint64_t> step(const std::vector<uint64_t>& v, const Matrix& m) const;
+	Prediction summarize(const std::vector<uint64_t>& counts) const;
+
+	std::string alphabet;			// Every symbol reachable from the axiom
+	std::vector<uint64_t> start;	// Symbol counts of the axiom
+	Matrix growth;					// Growth matrix
+};
+
+#endif
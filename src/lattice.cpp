@@ -0,0 +1,228 @@
+#include "lattice.hpp"
+#include <cmath>
+#include <climits>
+#include <cstdlib>
+#include <numeric>
+#include <algorithm>
+#include <glm/gtc/constants.hpp>
+
+// Lattice directions in order of heading, for each kind of lattice
+static const glm::ivec2 SQUARE[4] = { { 1, 0 }, { 0, 1 }, { -1, 0 }, { 0, -1 } };
+static const glm::ivec2 HEXAGONAL[6] = { { 1, 0 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { 0, -1 }, { 1, -1 } };
+
+// Rotate the low n bits of a mask up by k
+static uint64_t rotate(uint64_t mask, int k, int n) {
+	uint64_t all = (n == 64) ? ~0ull : (1ull << n) - 1;
+	if (k == 0)
+		return mask;
+	return ((mask << k) | (mask >> (n - k))) & all;
+}
+
+// Not a lattice
+Lattice::Lattice() :
+	n(0),
+	q(0),
+	r(0),
+	valid(false) {
+
+	for (unsigned int ch = 0; ch < 256; ch++) {
+		turns[ch] = 0;
+		ops[ch] = Turtle::Table::NONE;
+	}
+}
+
+// Find the lattice the grammar moves on, if there is one
+Lattice::Lattice(const std::string& axiom, const RuleTable& rules, float angle,
+	unsigned int maxIter) :
+	Lattice() {
+
+	this->rules = rules;
+	Turtle::Table table(angle);
+	for (unsigned int ch = 0; ch < 256; ch++)
+		ops[ch] = table.ops[ch];
+
+	// A whole number of headings, few enough for a 64-bit mask
+	if (angle <= 0.0f)
+		return;
+	double headings = 360.0 / angle;
+	n = (int)std::lround(headings);
+	if (n < 1 || n > 64 || std::abs(headings - n) > 1e-4)
+		return;
+	turns[(unsigned char)'+'] = 1;
+	turns[(unsigned char)'-'] = n - 1;
+
+	// No turns out of the plane anywhere in the grammar
+	auto planar = [&](const char* str, size_t len) {
+		for (size_t i = 0; i < len; i++)
+			if (ops[(unsigned char)str[i]] == Turtle::Table::TURN && !turns[(unsigned char)str[i]])
+				return false;
+		return true;
+	};
+	if (!planar(axiom.data(), axiom.size()))
+		return;
+	for (unsigned int ch = 0; ch < 256; ch++)
+		if (rules.hasRule((char)ch) && !planar(rules.image((char)ch), rules.length((char)ch)))
+			return;
+
+	// Headings moved along in any iteration, built up one depth at a time
+	std::vector<std::vector<Summary>> below(maxIter + 1, std::vector<Summary>(256));
+	uint64_t used = 0;
+	for (unsigned int depth = 0; depth <= maxIter; depth++) {
+		if (depth > 0)
+			for (unsigned int ch = 0; ch < 256; ch++)
+				if (rules.hasRule((char)ch))
+					below[depth][ch] = walk(rules.image((char)ch), rules.length((char)ch),
+						depth - 1, below);
+		Summary s = walk(axiom.data(), axiom.size(), depth, below);
+		if (!s.ok)
+			return;
+		used |= s.moves;
+	}
+
+	// Every heading used must be r + k * q for one of the lattices
+	const int kinds[2] = { 4, 6 };
+	for (int m : kinds) {
+		if (n % m)
+			continue;
+		q = n / m;
+		r = 0;
+		while (used && !(used >> r & 1))
+			r++;
+		r %= q;
+		bool fits = true;
+		for (int k = 0; k < n; k++)
+			if ((used >> k & 1) && k % q != r)
+				fits = false;
+		if (!fits)
+			continue;
+
+		unitSteps.assign(m == 4 ? SQUARE : HEXAGONAL, (m == 4 ? SQUARE : HEXAGONAL) + m);
+		steps.assign(n, glm::ivec2(0, 0));
+		for (int k = r; k < n; k += q)
+			steps[k] = (m == 4) ? SQUARE[(k - r) / q] : HEXAGONAL[(k - r) / q];
+		double step = 2.0 * glm::pi<double>() / n;
+		e1 = glm::vec3(0.0, std::cos(r * step), std::sin(r * step));
+		e2 = glm::vec3(0.0, std::cos((r + q) * step), std::sin((r + q) * step));
+		valid = true;
+		return;
+	}
+}
+
+// Lattice coordinates (a, b, 0) to a * e1 + b * e2
+glm::mat4 Lattice::basis() const {
+	glm::mat4 ret(1.0f);
+	ret[0] = glm::vec4(e1, 0.0f);
+	ret[1] = glm::vec4(e2, 0.0f);
+	ret[2] = glm::vec4(1.0f, 0.0f, 0.0f, 0.0f);
+	return ret;
+}
+
+// Every segment is a whole number of unit steps, the greatest common divisor
+// of its extent
+bool Lattice::packSegments(const std::vector<glm::ivec2>& verts,
+	std::vector<PackedSegment>& out) const {
+
+	out.clear();
+	out.reserve(verts.size() / 2);
+	for (size_t i = 0; i + 1 < verts.size(); i += 2) {
+		glm::ivec2 start = verts[i];
+		glm::ivec2 delta = verts[i + 1] - start;
+		int run = std::gcd(std::abs(delta.x), std::abs(delta.y));
+		if (!run)
+			continue;
+		glm::ivec2 unit = delta / run;
+		uint16_t dir = (uint16_t)(std::find(unitSteps.begin(), unitSteps.end(), unit) - unitSteps.begin());
+		if (dir == unitSteps.size())
+			return false;
+		while (run > 0) {
+			if (start.x < INT16_MIN || start.x > INT16_MAX || start.y < INT16_MIN || start.y > INT16_MAX)
+				return false;
+			int part = std::min(run, (int)UINT16_MAX);
+			out.push_back({ (int16_t)start.x, (int16_t)start.y, dir, (uint16_t)part });
+			start += part * unit;
+			run -= part;
+		}
+	}
+	return true;
+}
+
+// Summarize a symbol sequence at the given depth from the summaries of the
+// depth below
+Lattice::Summary Lattice::walk(const char* str, size_t len, unsigned int depth,
+	const std::vector<std::vector<Summary>>& below) const {
+
+	Summary ret{ 0, 0, true };
+	std::vector<int> stack;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char ch = str[i];
+		if (ch == '[')
+			stack.push_back(ret.net);
+		else if (ch == ']') {
+			if (stack.empty()) {
+				ret.ok = false;
+				return ret;
+			}
+			ret.net = stack.back();
+			stack.pop_back();
+		} else if (depth > 0 && rules.hasRule(ch)) {
+			const Summary& s = below[depth][ch];
+			if (!s.ok) {
+				ret.ok = false;
+				return ret;
+			}
+			ret.moves |= rotate(s.moves, ret.net, n);
+			ret.net = (ret.net + s.net) % n;
+		} else {
+			if (ops[ch] == Turtle::Table::DRAW || ops[ch] == Turtle::Table::MOVE)
+				ret.moves |= 1ull << ret.net;
+			ret.net = (ret.net + turns[ch]) % n;
+		}
+	}
+	ret.ok = stack.empty();
+	return ret;
+}
+
+// Start at the origin with the start heading
+LatticeTurtle::LatticeTurtle(const Lattice& lattice) :
+	minBB(INT_MAX, INT_MAX),
+	maxBB(INT_MIN, INT_MIN),
+	lattice(lattice),
+	pos(0, 0),
+	heading(0) {}
+
+// Interpret a block of symbols, appending drawn segments to verts
+void LatticeTurtle::feed(const char* str, size_t len) {
+	int n = lattice.headings();
+	for (size_t i = 0; i < len; i++) {
+		char ch = str[i];
+		switch (lattice.op(ch)) {
+		case Turtle::Table::DRAW:
+			verts.push_back(pos);
+			minBB = glm::min(minBB, pos);
+			maxBB = glm::max(maxBB, pos);
+			pos += lattice.step(heading);
+			verts.push_back(pos);
+			minBB = glm::min(minBB, pos);
+			maxBB = glm::max(maxBB, pos);
+			break;
+		case Turtle::Table::MOVE:
+			pos += lattice.step(heading);
+			break;
+		case Turtle::Table::TURN:
+			heading += lattice.turn(ch);
+			if (heading >= n)
+				heading -= n;
+			break;
+		case Turtle::Table::PUSH:
+			stack.emplace_back(pos, heading);
+			break;
+		case Turtle::Table::POP:
+			pos = stack.back().first;
+			heading = stack.back().second;
+			stack.pop_back();
+			break;
+		case Turtle::Table::NONE:
+			break;
+		}
+	}
+}
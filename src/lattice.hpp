@@ -0,0 +1,100 @@
+#ifndef LATTICE_HPP
+#define LATTICE_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "rules.hpp"
+#include "turtle.hpp"
+
+// A lattice segment in 8 bytes: its start, the lattice direction it runs
+// along and its length in steps
+struct PackedSegment {
+	int16_t x, y;				// Start in lattice coordinates
+	uint16_t dir;				// Index into Lattice::units
+	uint16_t run;				// Length in steps
+};
+
+// Exact integer geometry for planar grammars that stay on a lattice
+// Applies when the only turns are '+' and '-' (about X, so the turtle never
+// leaves the YZ plane), 360 / angle is a whole number n, and every heading
+// the turtle moves along is r + k * q turns from the start, for q = n / 4
+// (square lattice) or q = n / 6 (hexagonal lattice). Every position is then
+// a * e1 + b * e2 for integers a, b and basis vectors e1, e2.
+class Lattice {
+public:
+	Lattice();
+	// Check iterations up to maxIter of the given grammar
+	Lattice(const std::string& axiom, const RuleTable& rules, float angle, unsigned int maxIter);
+
+	// Whether the grammar stays on a lattice up to maxIter
+	bool isValid() const {
+		return valid; }
+	// Maps lattice coordinates (a, b, 0) to world space
+	glm::mat4 basis() const;
+
+	// Move in lattice coordinates along each of the n headings
+	const glm::ivec2& step(int heading) const {
+		return steps[heading]; }
+	// What a symbol does, and how many headings it turns by
+	Turtle::Table::Op op(char ch) const {
+		return ops[(unsigned char)ch]; }
+	int turn(char ch) const {
+		return turns[(unsigned char)ch]; }
+	// Number of headings
+	int headings() const {
+		return n; }
+	// The 4 or 6 unit steps of the lattice
+	const std::vector<glm::ivec2>& units() const {
+		return unitSteps; }
+
+	// Pack segment vertex pairs as start, direction and run length, splitting
+	// runs too long for 16 bits; false if a start does not fit in 16 bits
+	bool packSegments(const std::vector<glm::ivec2>& verts, std::vector<PackedSegment>& out) const;
+
+private:
+	// Net turn of a sequence and the headings it moves along, relative to
+	// its start
+	struct Summary {
+		int net;				// Net turn, in steps of the angle
+		uint64_t moves;			// Bit k: moves along start + k
+		bool ok;				// Only lattice turns and balanced brackets
+	};
+	Summary walk(const char* str, size_t len, unsigned int depth,
+		const std::vector<std::vector<Summary>>& below) const;
+
+	RuleTable rules;			// Rules applied at every step
+	int n;						// Number of headings
+	int q;						// Headings between lattice directions
+	int r;						// Heading of e1
+	Turtle::Table::Op ops[256];	// Opcode of each symbol
+	int turns[256];				// Heading change of each symbol, mod n
+	std::vector<glm::ivec2> steps;	// Move along each heading
+	std::vector<glm::ivec2> unitSteps;	// Lattice directions
+	glm::vec3 e1, e2;			// Basis vectors
+	bool valid;					// Grammar stays on the lattice
+};
+
+// Turtle interpreter on a lattice, emitting integer vertices
+class LatticeTurtle {
+public:
+	LatticeTurtle(const Lattice& lattice);
+
+	// Interpret a block of symbols
+	void feed(const char* str, size_t len);
+
+	// Geometry generated so far in lattice coordinates, every two vertices
+	// making a line segment, and its bounding box
+	std::vector<glm::ivec2> verts;
+	glm::ivec2 minBB;
+	glm::ivec2 maxBB;
+
+private:
+	const Lattice& lattice;		// Steps and turns
+	glm::ivec2 pos;				// Current position
+	int heading;				// Current heading, 0 to n - 1
+	std::vector<std::pair<glm::ivec2, int>> stack;	// Saved states
+};
+
+#endif
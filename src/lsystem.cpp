@@ -3,6 +3,8 @@
 #include <fstream>
 #include <sstream>
 #include <stack>
+#include <thread>
+#include <algorithm>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <math.h>
@@ -17,13 +19,47 @@ std::string trim(const std::string& line);
 unsigned int LSystem::refcount = 0;
 GLuint LSystem::shader = 0;
 GLuint LSystem::xformLoc = 0;
+GLuint LSystem::instShader = 0;
+GLuint LSystem::instXformLoc = 0;
+GLuint LSystem::segShader = 0;
+GLuint LSystem::segXformLoc = 0;
+GLuint LSystem::segUnitsLoc = 0;
 
 // Constructor
 LSystem::LSystem() :
+	numIter(0),
+	latestIter(0),
+	streaming(false),
+	memoize(true),
+	tasking(true),
+	useLattice(true),
+	merging(true),
+	dedup(true),
+	strips(true),
+	segPacking(true),
+	direct(true),
+	vertexFormat(VertexFormat::FLOAT3),
+	planar(false),
+	instancing(0),
+	maxIter(0),
 	angle(0.0f),
+	numThreads(std::max(1u, std::thread::hardware_concurrency())),
 	vao(0),
-	vbo(0),
-	bufSize(0) {
+	segVao(0),
+	budget(DEFAULT_BUDGET),
+	useClock(0),
+	shown(0),
+	hasJob(false),
+	busy(false),
+	quit(false),
+	jobIter(0),
+	jobTicket(0),
+	chunks(MAX_CHUNKS),
+	filling(),
+	accepted(0),
+	fills(0),
+	ticket(0),
+	working(0) {
 
 	// Create shader if we're the first object
 	if (refcount == 0)
@@ -33,53 +69,136 @@ LSystem::LSystem() :
 
 // Destructor
 LSystem::~LSystem() {
+	// Stop generating before anything goes away
+	stopWorker();
+	// Destroy instanced geometry
+	clearVerts();
 	// Destroy vertex buffer and array
 	if (vao) { glDeleteVertexArrays(1, &vao); vao = 0; }
-	if (vbo) { glDeleteBuffers(1, &vbo); vbo = 0; }
-	bufSize = 0;
+	if (segVao) { glDeleteVertexArrays(1, &segVao); segVao = 0; }
+	pages = PagedBuffer();
 
 	refcount--;
 	// Destroy shader if we're the last object
 	if (refcount == 0) {
 		if (shader) { glDeleteProgram(shader); shader = 0; }
+		if (instShader) { glDeleteProgram(instShader); instShader = 0; }
+		if (segShader) { glDeleteProgram(segShader); segShader = 0; }
 	}
 }
 
-// Move constructor
+// Move constructor; other's worker is stopped before anything is taken
 LSystem::LSystem(LSystem&& other) :
-	strings(std::move(other.strings)),
+	LSystem(std::move(other), stopped(other)) {}
+
+// End the worker of an LSystem about to be moved from
+LSystem::Stopped LSystem::stopped(LSystem& other) {
+	other.stopWorker();
+	return Stopped();
+}
+
+// Take everything from an LSystem whose worker has ended
+LSystem::LSystem(LSystem&& other, Stopped) :
+	numIter(other.numIter),
+	derivation(std::move(other.derivation)),
+	latest(std::move(other.latest)),
+	latestIter(other.latestIter),
+	streaming(other.streaming),
+	memoize(other.memoize),
+	tasking(other.tasking),
+	useLattice(other.useLattice),
+	merging(other.merging),
+	dedup(other.dedup),
+	strips(other.strips),
+	segPacking(other.segPacking),
+	direct(other.direct),
+	vertexFormat(other.vertexFormat),
+	planar(other.planar),
+	instancing(other.instancing),
 	rules(std::move(other.rules)),
+	ruleTable(other.ruleTable),
+	growth(std::move(other.growth)),
+	summaries(std::move(other.summaries)),
+	blocks(std::move(other.blocks)),
+	turtleTable(other.turtleTable),
+	branches(std::move(other.branches)),
+	lattice(std::move(other.lattice)),
+	maxIter(other.maxIter),
 	angle(other.angle),
+	numThreads(other.numThreads),
 	vao(other.vao),
-	vbo(other.vbo),
+	segVao(other.segVao),
 	iterData(std::move(other.iterData)),
-	bufSize(other.bufSize) {
+	pages(std::move(other.pages)),
+	budget(other.budget),
+	useClock(other.useClock),
+	shown(other.shown),
+	hasJob(false),
+	busy(false),
+	quit(false),
+	jobIter(0),
+	jobTicket(0),
+	chunks(MAX_CHUNKS),
+	filling(),
+	accepted(0),
+	fills(0),
+	ticket(0),
+	working(0) {
 
 	other.vao = 0;
-	other.vbo = 0;
-	other.bufSize = 0;
+	other.segVao = 0;
 	// Increment reference count (temp will decrement upon destructor)
 	refcount++;
 }
 
 // Move assignment operator
 LSystem& LSystem::operator=(LSystem&& other) {
-	strings = std::move(other.strings);
+	// Stop both workers, and release instanced geometry before taking other's
+	stopWorker();
+	other.stopWorker();
+	clearVerts();
+	numIter = other.numIter;
+	derivation = std::move(other.derivation);
+	latest = std::move(other.latest);
+	latestIter = other.latestIter;
+	streaming = other.streaming;
+	memoize = other.memoize;
+	tasking = other.tasking;
+	useLattice = other.useLattice;
+	merging = other.merging;
+	dedup = other.dedup;
+	strips = other.strips;
+	segPacking = other.segPacking;
+	direct = other.direct;
+	vertexFormat = other.vertexFormat;
+	planar = other.planar;
+	instancing = other.instancing;
 	rules = std::move(other.rules);
+	ruleTable = other.ruleTable;
+	growth = std::move(other.growth);
+	summaries = std::move(other.summaries);
+	blocks = std::move(other.blocks);
+	turtleTable = other.turtleTable;
+	branches = std::move(other.branches);
+	lattice = std::move(other.lattice);
+	maxIter = other.maxIter;
 	angle = other.angle;
+	numThreads = other.numThreads;
 	iterData = std::move(other.iterData);
-	bufSize = other.bufSize;
+	budget = other.budget;
+	useClock = other.useClock;
+	shown = other.shown;
 
 	// Release any existing buffers
 	if (vao) { glDeleteVertexArrays(1, &vao); }
-	if (vbo) { glDeleteBuffers(1, &vbo); }
+	if (segVao) { glDeleteVertexArrays(1, &segVao); }
 	// Acquire other's buffers
 	vao = other.vao;
-	vbo = other.vbo;
+	segVao = other.segVao;
+	pages = std::move(other.pages);
 
 	other.vao = 0;
-	other.vbo = 0;
-	other.bufSize = 0;
+	other.segVao = 0;
 	// Refcount stays the same
 
 	return *this;
@@ -124,19 +243,48 @@ void LSystem::parse(std::istream& istr) {
 	// END TODO ===============================================================
 
 
-	// Replace current state with parsed contents
+	// Replace current state with parsed contents, once nothing is being
+	// generated from it
+	settle();
 	angle = inAngle;
-	strings = { inAxiom };
+	numIter = 0;
+	latest = inAxiom;
+	latestIter = 0;
 	rules = std::move(inRules);
-	// Create geometry for axiom
-	iterData.clear();
-	auto verts = createGeometry(strings.back());
-	addVerts(verts);
+	ruleTable = RuleTable(rules);
+	derivation = Derivation(inAxiom, ruleTable);
+	derivation.grow(MAX_ITER);
+	growth = GrowthModel(inAxiom, ruleTable);
+	summaries = SummaryCache(inAxiom, ruleTable, angle);
+	blocks = BlockCache(ruleTable, angle);
+	turtleTable = Turtle::Table(angle);
+	branches = BranchEngine(inAxiom, ruleTable, turtleTable);
+	lattice = Lattice(inAxiom, ruleTable, angle, MAX_ITER);
 
-	// Perform iterations
+	// Turning only about X keeps the turtle in the YZ plane
+	auto flat = [&](const std::string& str) {
+		for (char ch : str)
+			if (turtleTable.ops[(unsigned char)ch] == Turtle::Table::TURN && ch != '+' && ch != '-')
+				return false;
+		return true;
+	};
+	planar = flat(inAxiom);
+	for (auto& r : rules)
+		planar = planar && flat(r.second);
+	maxIter = fitIterations();
+
+	// Refuse iterations whose geometry would not fit before building any
+	if (inIters > maxIter + 1) {
+		std::cerr << "Too many iterations: geometry exceeds maximum buffer size after iteration "
+			<< maxIter << std::endl;
+		inIters = maxIter + 1;
+	}
+
+	// Show the last iteration; its geometry is built when first drawn
+	clearVerts();
+	iterData.clear();
 	try {
-		while (strings.size() < inIters)
-			iterate();
+		jumpTo(inIters ? inIters - 1 : 0);
 	} catch (const std::exception& e) {
 		// Failed to iterate, stop at last iter
 		std::cerr << "Too many iterations: geometry exceeds maximum buffer size" << std::endl;
@@ -163,26 +311,293 @@ void LSystem::parseFile(std::string filename) {
 	parse(ss);
 }
 
-// Apply rules to the latest string to generate the next string
+// Generate the iteration after the last one
 unsigned int LSystem::iterate() {
-	if (strings.empty()) return 0;
-
-	// Apply rules to last string
-	std::string newString = applyRules(strings.back());
-	// Get geometry of new iteration
-	auto verts = createGeometry(newString);
+	if (!numIter) return 0;
+	return jumpTo(numIter);
+}
 
-	// Check for too-large buffer
-	auto& id = iterData.back();
-	if ((id.first + id.count + verts.size()) * sizeof(glm::vec3) > MAX_BUF)
+// Check that iteration N fits and make room for its data; nothing is
+// generated until it is drawn
+unsigned int LSystem::jumpTo(unsigned int iter) {
+	// Check for too-large buffer before doing any work
+	if (iter > maxIter)
 		throw std::runtime_error("geometry exceeds maximum buffer size");
+	if (iter >= numIter) {
+		numIter = iter + 1;
+		iterData.resize(numIter, IterData());
+	}
+	return getNumIter();
+}
 
+// Hand iteration N to the worker, or upload what the worker has of it
+// A progressive iteration is opened as soon as the worker starts on it and
+// filled from the chunk queue every frame until its result arrives
+void LSystem::build(unsigned int iter) {
+	std::unique_ptr<Prepared> opened, ready;
+	bool inFlight;
+	{
+		std::lock_guard<std::mutex> guard(jobLock);
+		if (opening && opening->iter == iter)
+			opened = std::move(opening);
+		if (result && result->iter == iter)
+			ready = std::move(result);
+		inFlight = jobIter == iter && (hasJob || busy);
+	}
+	if (opened)
+		startFilling(*opened);
+	bool filled = filling.active && filling.iter == iter;
+	if (filled)
+		drainChunks();
+	if (ready)
+		finish(*ready);
+	if (ready || inFlight || filled)
+		return;
 
-	// Store new iteration
-	strings.push_back(newString);
-	addVerts(verts);
+	// A new request; whatever was being filled is given up
+	stopFilling();
+	{
+		std::lock_guard<std::mutex> guard(jobLock);
+		result.reset();
+		opening.reset();
+		if (!worker.joinable())
+			worker = std::thread(&LSystem::work, this);
+		jobIter = iter;
+		jobTicket = ++ticket;
+		hasJob = true;
+	}
+	jobSignal.notify_all();
+}
 
-	return getNumIter();
+// Generate the geometry of p.iter and everything needed to upload it,
+// checking between steps whether it is still wanted
+void LSystem::prepare(Prepared& p) {
+	unsigned int iter = p.iter;
+	p.instanced = instancing && blocks.isValid();
+	p.bytes = p.instanced ? instancedSize(iter) :
+		2 * growth.predict(iter).segments * vertexSize();
+	checkCancel();
+
+	// Instanced iterations have buffers of their own
+	if (p.instanced) {
+		p.inst = blocks.instances(derivation.getAxiom(), iter, instancing,
+			[this]() { return cancelled(); });
+		checkCancel();
+		p.bbfix = fitBounds(iter, {});
+		p.basis = glm::mat4(1.0f);
+		p.deduped = p.merged = p.joined = 0;
+	} else if (onLattice())
+		prepareLattice(p);
+	else if (!writesDirect(iter) || !prepareDirect(p)) {
+		auto geom = generate(iter);
+		checkCancel();
+		prepareVerts(p, geom);
+	}
+}
+
+// Upload a prepared iteration, first evicting the least recently drawn
+// iterations until it fits in the budget
+void LSystem::finish(Prepared& p) {
+	if (p.iter >= numIter)
+		return;
+	IterData& id = iterData[p.iter];
+	if (!p.error.empty()) {
+		std::cerr << "Failed to build iteration " << p.iter << ": " << p.error << std::endl;
+		if (p.progressive)
+			stopFilling();
+		id.failed = true;
+		return;
+	}
+
+	// Everything has been drained, so the open allocation is complete
+	if (p.progressive) {
+		if (!filling.active || filling.iter != p.iter || filling.fill != p.fill)
+			return;
+		growParts(pages.end());
+		id.strips += filling.open;
+		id.joined = p.joined;
+		id.built = true;
+		id.growing = false;
+		filling.active = false;
+		filling.openIn.clear();
+		return;
+	}
+
+	makeRoom(p.iter, p.bytes);
+	id.deduped = p.deduped;
+	id.merged = p.merged;
+	id.joined = p.joined;
+	id.basis = p.basis;
+	id.bbfix = p.bbfix;
+	if (p.instanced)
+		addInstances(p.iter, p.inst);
+	else
+		upload(p.iter, p.data.data(), p.count, p.size, p.type, p.stride, p.starts, p.packed);
+}
+
+// Evict the least recently drawn iterations other than N until bytes more
+// fit in the budget, then let go of spare pages over it
+void LSystem::makeRoom(unsigned int iter, uint64_t bytes) {
+	while (residentBytes() + bytes > budget) {
+		unsigned int oldest = numIter;
+		for (unsigned int i = 0; i < numIter; i++)
+			if (i != iter && iterData[i].built &&
+				(oldest == numIter || iterData[i].lastUse < iterData[oldest].lastUse))
+				oldest = i;
+		if (oldest == numIter)
+			break;
+		evict(oldest);
+	}
+	pages.trim(budget);
+}
+
+// Prepare one job at a time; a job outdated by a newer request is dropped
+// as soon as it notices, and its result, if it got that far, is not kept
+void LSystem::work() {
+	std::unique_lock<std::mutex> lock(jobLock);
+	while (true) {
+		jobSignal.wait(lock, [this]() { return quit || hasJob; });
+		if (quit)
+			return;
+		auto p = std::make_unique<Prepared>();
+		p->iter = jobIter;
+		p->ticket = jobTicket;
+		working = jobTicket;
+		hasJob = false;
+		busy = true;
+		lock.unlock();
+
+		try {
+			prepare(*p);
+		} catch (const Cancelled&) {
+			p.reset();
+		} catch (const std::exception& e) {
+			p->error = e.what();
+		}
+
+		lock.lock();
+		busy = false;
+		if (p && working == ticket)
+			result = std::move(p);
+		jobSignal.notify_all();
+	}
+}
+
+// Called by the worker between steps of a job
+void LSystem::checkCancel() const {
+	if (cancelled())
+		throw Cancelled();
+}
+
+// Polled by the engines that cannot throw from their threads; they give up
+// and return nothing, and the worker's next checkCancel throws
+bool LSystem::cancelled() const {
+	return working != ticket;
+}
+
+// Outdate whatever the worker has, and wait until it is idle
+void LSystem::settle() {
+	{
+		std::unique_lock<std::mutex> lock(jobLock);
+		++ticket;
+		hasJob = false;
+		result.reset();
+		opening.reset();
+		jobSignal.wait(lock, [this]() { return !busy; });
+	}
+	// A fill whose job is gone would never finish
+	stopFilling();
+}
+
+// Outdate whatever the worker has, and wait for it to exit
+void LSystem::stopWorker() {
+	stopFilling();
+	if (!worker.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> guard(jobLock);
+		++ticket;
+		quit = true;
+		hasJob = false;
+	}
+	jobSignal.notify_all();
+	worker.join();
+	quit = false;
+	result.reset();
+	opening.reset();
+}
+
+// Free an iteration's pieces and instance buffers; it is rebuilt from the
+// derivation if drawn again
+void LSystem::evict(unsigned int iter) {
+	if (filling.active && filling.iter == iter) {
+		stopFilling();
+		return;
+	}
+	IterData& id = iterData[iter];
+	std::vector<PagedBuffer::Piece> pieces;
+	for (auto& part : id.parts)
+		pieces.push_back(part.piece);
+	pages.free(pieces);
+	id.parts.clear();
+	if (id.instVao) { glDeleteVertexArrays(1, &id.instVao); id.instVao = 0; }
+	if (id.instVbo) { glDeleteBuffers(1, &id.instVbo); id.instVbo = 0; }
+	id.groups.clear();
+	id.built = false;
+}
+
+// Pages in use plus instanced buffers
+uint64_t LSystem::residentBytes() const {
+	uint64_t ret = pages.resident();
+	for (auto& id : iterData)
+		if (id.built && id.instVbo)
+			ret += id.bytes;
+	return ret;
+}
+
+// Create geometry for iteration N from the cheapest available source
+std::vector<glm::vec3> LSystem::generate(unsigned int iter) {
+	auto cancel = [this]() { return cancelled(); };
+	if (tasking && numThreads > 1 && branches.isValid())
+		return branches.geometry(iter, numThreads, cancel);
+	if (memoize && blocks.isValid())
+		return blocks.geometry(derivation.getAxiom(), iter, cancel);
+	if (streaming || derivation.length(iter) > MAX_STRING)
+		return streamGeometry(iter);
+
+	// Rewrite the latest string with the rules composed as many times as
+	// needed, or start over from the axiom if it is past iteration N
+	// getString reads the latest string on the GL thread
+	if (latestIter > iter) {
+		std::lock_guard<std::mutex> guard(jobLock);
+		latest = derivation.getAxiom();
+		latestIter = 0;
+	}
+	unsigned int steps = iter - latestIter;
+	if (steps > 0) {
+		std::string next = applyRules(latest, steps);
+		std::lock_guard<std::mutex> guard(jobLock);
+		latest = std::move(next);
+	}
+	{
+		std::lock_guard<std::mutex> guard(jobLock);
+		latestIter = iter;
+	}
+
+	// Get geometry of new iteration
+	return createGeometry(latest, derivation.maxNesting(iter), growth.predict(iter).segments);
+}
+
+// Get the string of a given iteration, deriving it if it was not kept
+std::string LSystem::getString(unsigned int iter) const {
+	if (iter >= numIter)
+		throw std::out_of_range("iteration not generated");
+	{
+		std::lock_guard<std::mutex> guard(jobLock);
+		if (iter == latestIter)
+			return latest;
+	}
+	return derivation.expand(iter);
 }
 
 // Draw the latest iteration of the L-System
@@ -193,195 +608,513 @@ void LSystem::draw(glm::mat4 viewProj) {
 
 // Draw a specific iteration of the L-System
 void LSystem::drawIter(unsigned int iter, glm::mat4 viewProj, float line_width) {
-	IterData& id = iterData.at(iter);
+	if (iter >= numIter) return;
+	if ((!iterData[iter].built || iterData[iter].growing) && !iterData[iter].failed) {
+		try {
+			build(iter);
+		} catch (const std::exception& e) {
+			std::cerr << "Failed to build iteration " << iter << ": " << e.what() << std::endl;
+			evict(iter);
+			iterData[iter].failed = true;
+		}
+	}
+	// Keep drawing the last iteration shown until this one is ready
+	if (!iterData[iter].built) {
+		if (shown >= numIter || !iterData[shown].built)
+			return;
+		iter = shown;
+	}
+	shown = iter;
+	IterData& id = iterData[iter];
+	id.lastUse = ++useClock;
 
-	glUseProgram(shader);
-	glBindVertexArray(vao);
 	glm::mat4 res = glm::mat4(1.0f);
 	rot += 2.0;
 	res[0] = glm::vec4(cos(glm::radians(rot)), 0.0f, -sin(glm::radians(rot)), 0.0f);
 	res[2] = glm::vec4(sin(glm::radians(rot)), 0.0f, cos(glm::radians(rot)), 0.0f);
-	
+	glm::mat4 xform = viewProj * id.bbfix * res * id.basis;
+	if (id.instVao) {
+		drawInstances(id, xform);
+		return;
+	}
+	if (id.packed) {
+		drawSegments(id, xform);
+		return;
+	}
+
+	glUseProgram(shader);
+	glBindVertexArray(vao);
 	// Send matrix to shader
-	glm::mat4 xform = viewProj * id.bbfix * res;
 	glUniformMatrix4fv(xformLoc, 1, GL_FALSE, glm::value_ptr(xform));
 	glUniform1f(time_uniform_loc, cur_time);
-	// Draw L-System
-	glDrawArrays(GL_LINES, id.first, id.count);
+	// Draw L-System one page at a time, pointing the vertex attribute at
+	// each piece in this iteration's format
+	for (auto& part : id.parts) {
+		glBindBuffer(GL_ARRAY_BUFFER, part.piece.vbo);
+		glVertexAttribPointer(0, id.size, id.type, GL_FALSE, 0, (GLvoid*)part.piece.offset);
+		if (id.strips)
+			glMultiDrawArrays(GL_LINE_STRIP, part.stripFirst.data(), part.stripCount.data(),
+				(GLsizei)part.stripCount.size());
+		else
+			glDrawArrays(GL_LINES, 0, part.piece.count);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	glBindVertexArray(0);
 	glUseProgram(0);
 }
 
-// Apply rules to a given string and return the result
-std::string LSystem::applyRules(std::string string) {
+// Draw an instanced iteration, one call per distinct block
+void LSystem::drawInstances(IterData& id, glm::mat4 xform) {
+	glUseProgram(instShader);
+	glUniformMatrix4fv(instXformLoc, 1, GL_FALSE, glm::value_ptr(xform));
+	glBindVertexArray(id.instVao);
+	glBindBuffer(GL_ARRAY_BUFFER, id.instVbo);
 
-	// TODO: ==================================================================
-	// Apply rules to the input string
-	// Return the resulting string
-	std::string ret;
-	for(auto ch : string){
-		if(rules.count(ch)){
-			ret += rules[ch];
-		}
-		else{
-			ret += ch;
-		}
+	// GL 3.3 has no base instance, so point the frame attributes at each
+	// block's copies in turn
+	for (auto& g : id.groups) {
+		GLsizeiptr frames = id.frameOffset + (GLsizeiptr)g.firstFrame * 2 * sizeof(glm::vec3);
+		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 2 * sizeof(glm::vec3),
+			(GLvoid*)frames);
+		glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 2 * sizeof(glm::vec3),
+			(GLvoid*)(frames + sizeof(glm::vec3)));
+		glDrawArraysInstanced(GL_LINES, g.firstVert, g.numVerts, g.numFrames);
+	}
+
+	glBindVertexArray(0);
+	glUseProgram(0);
+}
+
+// Apply rules to a given string and return the result
+// Rewriting is context-free, so the string is rewritten a block at a time
+// straight into the result, checking between blocks whether it is still
+// wanted; blocks are CANCEL_BLOCK symbols per thread, so all of them work
+std::string LSystem::applyRules(const std::string& string, unsigned int steps) {
+	RuleTable table = (steps == 1) ? ruleTable : ruleTable.power(steps);
+	std::string ret(table.outputLength(string.data(), string.size()), '\0');
+	size_t block = CANCEL_BLOCK * numThreads;
+	size_t at = 0;
+	for (size_t pos = 0; pos < string.size(); pos += block) {
+		checkCancel();
+		at += table.applyParallel(string.data() + pos, std::min(block, string.size() - pos),
+			&ret[at], numThreads);
 	}
-	// Replace this line with your implementation
 	return ret;
 }
 
 // Generate the geometry corresponding to the string at the given iteration
-std::vector<glm::vec3> LSystem::createGeometry(std::string string) {
-	std::vector<glm::vec3> verts;
+// The turtle carries its state across blocks of CANCEL_BLOCK symbols per
+// thread, checking for cancellation between them
+std::vector<glm::vec3> LSystem::createGeometry(const std::string& string,
+	uint64_t nesting, uint64_t segments) {
+	Turtle turtle(turtleTable);
+	turtle.reserve(nesting, segments);
+	size_t block = CANCEL_BLOCK * numThreads;
+	for (size_t pos = 0; pos < string.size(); pos += block) {
+		checkCancel();
+		turtle.feedParallel(string.data() + pos, std::min(block, string.size() - pos), numThreads);
+	}
+	return std::move(turtle.verts);
+}
 
-	// TODO: ==================================================================
-	// Generate geometry from a string
-	// Return a vector of vertices, with every two vertices making a 2D line
-	// segment.
-	glm::vec3 curr = glm::vec3(0.0f, 0.0f, 0.0f);
-	glm::vec3 prev = glm::vec3(0.0f, 0.0f, 0.0f);
-	glm::vec3 dir = glm::vec3(0.0f, 1.0f, 0.0f);
-	glm::mat3 ru = glm::mat4(1.0f);
-	glm::mat3 rl = glm::mat4(1.0f);
-	glm::mat3 rh = glm::mat4(1.0f);
-	std::stack<glm::vec3> curr_stack;
-	std::stack<glm::vec3> prev_stack;
-	std::stack<glm::vec3> dir_stack;
-	std::stack<float> ang_stack;
-	float pi = 3.1415926;
-	float ang = angle;
-	ru[0] = glm::vec3(cos(glm::radians(45.0)), sin(glm::radians(45.0)), 0.0f);
-	ru[1] = glm::vec3(-sin(glm::radians(45.0)), cos(glm::radians(45.0)), 0.0f);
-	//dir = ru * dir; 
-	for(auto ch : string){
-		if (ch == 'f' || ch == 'F' || ch == 'g' || ch == 'G') {
-			curr[0] = curr[0] + dir[0];
-			curr[1] = curr[1] + dir[1];
-			curr[2] = curr[2] + dir[2];
-			verts.push_back(prev);
-			verts.push_back(curr);
-			prev = curr;
-		}
-		else if (ch == 's' || ch == 'S') {
-			curr[0] = curr[0] + dir[0];
-			curr[1] = curr[1] + dir[1];
-			curr[2] = curr[2] + dir[2];
-			prev = curr;
-		}
-		else if(ch == '+'){
-			glm::mat4 x_rot = glm::rotate(glm::radians(ang), glm::vec3(1.0,0.0,0.0));
-			dir = glm::vec3(x_rot * glm::vec4(dir, 0.0));
-		}
-		else if(ch == '-'){
-			glm::mat4 x_rot = glm::rotate(glm::radians(-ang), glm::vec3(1.0,0.0,0.0));
-			dir = glm::vec3(x_rot * glm::vec4(dir, 0.0));
-		}
-		else if(ch == '&'){
-			glm::mat4 y_rot = glm::rotate(glm::radians(ang), glm::vec3(0.0,1.0,0.0));
-			dir = glm::vec3(y_rot * glm::vec4(dir, 0.0));
+// Generate the geometry of an iteration by feeding the turtle symbols as
+// they are derived, so only O(iter) derivation state is ever held
+std::vector<glm::vec3> LSystem::streamGeometry(unsigned int iter) {
+	Turtle turtle(turtleTable);
+	turtle.reserve(derivation.maxNesting(iter), growth.predict(iter).segments);
+	uint64_t fed = 0;
+	derivation.stream(iter, [&](const char* str, size_t len) {
+		if ((fed += len) >= CANCEL_BLOCK) {
+			checkCancel();
+			fed = 0;
 		}
-		else if(ch == '^'){
-			//rl = glm::mat4(1.0f);
-			//rl[0] = glm::vec3(cos(glm::radians(-ang)), 0.0f, -sin(glm::radians(-ang)));
-			//rl[2] = glm::vec3(sin(glm::radians(-ang)), 0.0f, cos(glm::radians(-ang)));
-			glm::mat4 y_rot = glm::rotate(glm::radians(-ang), glm::vec3(0.0,1.0,0.0));
-			dir = glm::vec3(y_rot * glm::vec4(dir, 0.0));
-		}
-		else if(ch == '\\'){
-			glm::mat4 z_rot = glm::rotate(glm::radians(ang), glm::vec3(0.0,0.0,1.0));
-			dir = glm::vec3(z_rot * glm::vec4(dir, 0.0));
-		}
-		else if(ch == '/'){
-			glm::mat4 z_rot = glm::rotate(glm::radians(-ang), glm::vec3(0.0,0.0,1.0));
-			dir = glm::vec3(z_rot * glm::vec4(dir, 0.0));
+		turtle.feed(str, len);
+	});
+	return std::move(turtle.verts);
+}
+
+void LSystem::update_time(float time) {
+	cur_time = time;
+}
+
+// Simplify and pack given geometry for the OpenGL vertex buffer
+void LSystem::prepareVerts(Prepared& p, std::vector<glm::vec3>& verts) {
+	p.bbfix = fitBounds(p.iter, verts);
+	p.deduped = dedup ? removeDuplicates(verts, numThreads) : 0;
+	checkCancel();
+	p.merged = merging ? mergeCollinear(verts) : 0;
+	p.joined = strips ? joinStrips(verts, p.starts) : 0;
+	checkCancel();
+	PackedVerts packed = packVerts(verts, vertexFormat);
+	p.basis = packed.basis;
+	p.data = std::move(packed.data);
+	p.count = verts.size();
+	p.size = packed.size;
+	p.type = packed.type;
+	p.stride = verts.empty() ? 0 : p.data.size() / verts.size();
+	p.packed = false;
+}
+
+// Direct writes skip the passes that need all of an iteration, so they are
+// only for iterations without them or too large to hold
+bool LSystem::writesDirect(unsigned int iter) const {
+	uint64_t hostBytes = 2 * growth.predict(iter).segments * sizeof(glm::vec3);
+	return direct && (!(dedup || merging) || hostBytes > MAX_HOST);
+}
+
+// Feed the turtle symbols as they are derived, and pack its vertices into
+// chunks for the GL thread, joining strips across blocks the way joinStrips
+// does; only the turtle state and the queued chunks are ever held
+// The box is predicted so the view does not move as the chunks arrive, and
+// the layout is published before the first chunk so drawing can start at
+// once. The float turtle can drift a little outside the prediction; if a
+// format would clamp a vertex that did by more than rounding would, the
+// iteration is packed again over the box of the vertices actually seen. Returns false, leaving the
+// iteration to the other paths, if there is no predicted box.
+bool LSystem::prepareDirect(Prepared& p) {
+	unsigned int iter = p.iter;
+	glm::vec3 minBB, maxBB;
+	if (!predictBounds(iter, minBB, maxBB))
+		return false;
+
+	p.progressive = true;
+	p.bbfix = fitBox(minBB, maxBB);
+	p.packed = false;
+	p.deduped = 0;
+	p.merged = 0;
+	glm::vec3 lo = minBB, hi = maxBB;
+	while (!streamDirect(p, lo, hi)) {}
+	return true;
+}
+
+// One pass of prepareDirect, packing over the box [lo, hi]; false, with the
+// box grown to the vertices seen, if any of them was clamped
+bool LSystem::streamDirect(Prepared& p, glm::vec3& lo, glm::vec3& hi) {
+	unsigned int iter = p.iter;
+	VertexPacker packer(vertexFormat, lo, hi, planar);
+	GLsizeiptr stride = (GLsizeiptr)packer.stride();
+	p.bytes = 2 * growth.predict(iter).segments * stride;
+	p.basis = packer.basis;
+	p.size = packer.size;
+	p.type = packer.type;
+	p.stride = stride;
+	p.fill = ++fills;
+	{
+		std::lock_guard<std::mutex> guard(jobLock);
+		if (working != ticket)
+			throw Cancelled();
+		opening = std::make_unique<Prepared>(p);
+	}
+
+	Turtle turtle(turtleTable);
+	turtle.reserve(derivation.maxNesting(iter), 0);
+	Chunk chunk{ p.fill, {}, 0, {} };
+	uint64_t drawn = 0;
+	uint64_t count = 0;
+	glm::vec3 last(0.0f);
+	glm::vec3 seenMin = lo, seenMax = hi;
+	derivation.stream(iter, [&](const char* str, size_t len) {
+		turtle.feed(str, len);
+		auto& verts = turtle.verts;
+		if (packer.clamps())
+			for (auto& v : verts) {
+				seenMin = glm::min(seenMin, v);
+				seenMax = glm::max(seenMax, v);
+			}
+		size_t at = chunk.data.size();
+		chunk.data.resize(at + verts.size() * stride);
+		unsigned char* out = chunk.data.data() + at;
+		for (size_t i = 0; i + 1 < verts.size(); i += 2) {
+			if (!strips || count == 0 || !(verts[i] == last)) {
+				if (strips)
+					chunk.starts.push_back(count);
+				packer.pack(verts[i], out);
+				out += stride;
+				count++;
+			}
+			packer.pack(verts[i + 1], out);
+			out += stride;
+			count++;
+			last = verts[i + 1];
 		}
-		else if(ch == '|'){
-			ru = glm::mat4(1.0f);
-			ru[0] = glm::vec3(cos(glm::radians(180.0)), sin(glm::radians(180.0)), 0.0f);
-			ru[1] = glm::vec3(-sin(glm::radians(180.0)), cos(glm::radians(180.0)), 0.0f);
-			dir = ru * dir;
+		chunk.data.resize(out - chunk.data.data());
+		chunk.count = chunk.data.size() / stride;
+		drawn += verts.size();
+		verts.clear();
+		if (chunk.data.size() >= CHUNK_BYTES) {
+			pushChunk(chunk);
+			chunk = Chunk{ p.fill, {}, 0, {} };
 		}
-		else if(ch == '['){
-			prev_stack.push(prev);
-			curr_stack.push(curr);
-			ang_stack.push(ang);
-			dir_stack.push(dir);
+	});
+	if (chunk.count)
+		pushChunk(chunk);
+
+	p.count = count;
+	p.joined = drawn - count;
+	bool fits = !packer.clamps() ||
+		(glm::all(glm::greaterThanEqual(seenMin, lo - packer.slack())) &&
+		glm::all(glm::lessThanEqual(seenMax, hi + packer.slack())));
+	lo = seenMin;
+	hi = seenMax;
+	return fits;
+}
+
+// Chunks wait until the GL thread has opened the iteration, so none are
+// lost to the chunks of earlier jobs it drops; then it empties the queue
+// every frame. A cancelled job stops waiting.
+void LSystem::pushChunk(Chunk& chunk) {
+	checkCancel();
+	while (accepted != chunk.fill || !chunks.push(chunk)) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		checkCancel();
+	}
+}
+
+// Make room for the whole iteration and open an allocation for its chunks;
+// a new pass of the job being filled replaces the old one
+void LSystem::startFilling(Prepared& p) {
+	stopFilling(!filling.active || filling.ticket != p.ticket);
+	if (p.iter >= numIter)
+		return;
+	makeRoom(p.iter, p.bytes);
+	IterData& id = iterData[p.iter];
+	id.basis = p.basis;
+	id.bbfix = p.bbfix;
+	id.deduped = 0;
+	id.merged = 0;
+	id.joined = 0;
+	id.growing = true;
+	filling = Filling{ true, p.iter, p.ticket, p.fill, 0, p.size, p.type, p.stride, false, 0, 0, {} };
+	pages.begin(p.stride, strips ? 1 : 2, strips ? 1 : 0);
+
+	// Nothing to draw yet, so the shown iteration stays up until it arrives
+	store(p.iter, {}, 0, p.size, p.type, p.stride, {}, false);
+	id.built = false;
+	accepted = p.fill;
+}
+
+// Write every queued chunk of the job filling the iteration, dropping those
+// of cancelled jobs, and draw what is in the pages so far
+// Only the new strips are split among the parts; the last strip is split
+// again every time, as far as it has come
+void LSystem::drainChunks() {
+	IterData& id = iterData[filling.iter];
+	std::vector<uint64_t> started;
+	uint64_t before = filling.count;
+	Chunk chunk;
+	while (chunks.pop(chunk)) {
+		if (chunk.fill != filling.fill)
+			continue;
+		pages.write(chunk.data.data(), chunk.count);
+		started.insert(started.end(), chunk.starts.begin(), chunk.starts.end());
+		filling.count += chunk.count;
+	}
+	if (filling.count == before)
+		return;
+
+	for (size_t i : filling.openIn) {
+		id.parts[i].stripFirst.pop_back();
+		id.parts[i].stripCount.pop_back();
+	}
+	filling.openIn.clear();
+	growParts(pages.progress());
+	if (strips) {
+		for (uint64_t first : started) {
+			if (filling.open) {
+				splitStrip(filling.openFirst, first, false);
+				id.strips++;
+			}
+			filling.open = true;
+			filling.openFirst = first;
+			while (filling.openPart + 1 < id.parts.size() &&
+				first >= id.parts[filling.openPart].piece.first + id.parts[filling.openPart].piece.count)
+				filling.openPart++;
 		}
-		else if(ch == ']'){
-			prev = prev_stack.top();
-			curr = curr_stack.top();
-			ang = ang_stack.top();
-			dir = dir_stack.top();
-			dir_stack.pop();
-			prev_stack.pop();
-			curr_stack.pop();
-			ang_stack.pop();
+		if (filling.open)
+			splitStrip(filling.openFirst, filling.count, true);
+	}
+	id.count = filling.count;
+	id.bytes = filling.count * filling.stride;
+	id.built = true;
+}
+
+// Take on pieces the open allocation has grown by; only the last known
+// piece can have changed
+void LSystem::growParts(const std::vector<PagedBuffer::Piece>& pieces) {
+	IterData& id = iterData[filling.iter];
+	for (size_t i = id.parts.empty() ? 0 : id.parts.size() - 1; i < pieces.size(); i++) {
+		if (i == id.parts.size())
+			id.parts.push_back(Part());
+		id.parts[i].piece = pieces[i];
+	}
+}
+
+// Add strip [first, last) to the parts it lies in, the way store splits
+// strips, starting from the part the last strip started in
+void LSystem::splitStrip(uint64_t first, uint64_t last, bool open) {
+	IterData& id = iterData[filling.iter];
+	for (size_t i = filling.openPart; i < id.parts.size(); i++) {
+		Part& part = id.parts[i];
+		uint64_t end = part.piece.first + part.piece.count;
+		uint64_t from = std::max(first, part.piece.first);
+		uint64_t to = std::min(last, end);
+		if (to >= from + 2) {
+			part.stripFirst.push_back((GLint)(from - part.piece.first));
+			part.stripCount.push_back((GLsizei)(to - from));
+			if (open)
+				filling.openIn.push_back(i);
 		}
+		if (last <= end)
+			break;
 	}
-	return verts;
 }
 
-void LSystem::update_time(float time) {
-	cur_time = time;
+// Give back what was written of the progressive iteration, and cancel the
+// job filling it if asked; it is generated again if it is drawn again
+// Chunks still queued are dropped, and no more are taken until the next
+// iteration is opened.
+void LSystem::stopFilling(bool cancel) {
+	accepted = 0;
+	Chunk chunk;
+	while (chunks.pop(chunk)) {}
+	if (!filling.active)
+		return;
+	if (cancel) {
+		std::lock_guard<std::mutex> guard(jobLock);
+		if (ticket == filling.ticket)
+			++ticket;
+	}
+	pages.free(pages.end());
+	if (filling.iter < iterData.size()) {
+		IterData& id = iterData[filling.iter];
+		id.parts.clear();
+		id.built = false;
+		id.growing = false;
+	}
+	filling.active = false;
+	filling.openIn.clear();
 }
 
-// Add given geometry to the OpenGL vertex buffer and update state accordingly
-void LSystem::addVerts(std::vector<glm::vec3>& verts) {
-	// Add iteration data
-	IterData id;
-	if (iterData.empty())
-		id.first = 0;
-	else {
-		auto& lastID = iterData.back();
-		id.first = lastID.first + lastID.count;
+// Run the integer turtle and keep its vertices, as 16-bit integers when they
+// fit and 32-bit otherwise; the lattice basis maps them to world space
+void LSystem::prepareLattice(Prepared& p) {
+	unsigned int iter = p.iter;
+	LatticeTurtle turtle(lattice);
+	turtle.verts.reserve(2 * growth.predict(iter).segments);
+	uint64_t fed = 0;
+	derivation.stream(iter, [&](const char* str, size_t len) {
+		if ((fed += len) >= CANCEL_BLOCK) {
+			checkCancel();
+			fed = 0;
+		}
+		turtle.feed(str, len);
+	});
+
+	p.basis = lattice.basis();
+	glm::vec3 minBB, maxBB;
+	if (!predictBounds(iter, minBB, maxBB)) {
+		// Box around the corners of the lattice box
+		minBB = glm::vec3(std::numeric_limits<float>::max());
+		maxBB = glm::vec3(std::numeric_limits<float>::lowest());
+		for (int corner = 0; corner < 4; corner++) {
+			glm::ivec2 c((corner & 1) ? turtle.maxBB.x : turtle.minBB.x,
+				(corner & 2) ? turtle.maxBB.y : turtle.minBB.y);
+			glm::vec3 w = glm::vec3(p.basis * glm::vec4(c.x, c.y, 0.0f, 1.0f));
+			minBB = glm::min(minBB, w);
+			maxBB = glm::max(maxBB, w);
+		}
 	}
-	id.count = verts.size();
+	p.bbfix = fitBox(minBB, maxBB);
 
-	// Calculate bounding box and create adjustment matrix
-	glm::vec3 minBB = glm::vec3(std::numeric_limits<float>::max());
-	glm::vec3 maxBB = glm::vec3(std::numeric_limits<float>::lowest());
+	auto& verts = turtle.verts;
+	p.deduped = dedup ? removeDuplicates(verts, numThreads) : 0;
+	checkCancel();
+	p.merged = merging ? mergeCollinear(verts) : 0;
+	p.joined = 0;
+	p.size = 2;
+	bool narrow = verts.empty() ||
+		(glm::all(glm::greaterThanEqual(turtle.minBB, glm::ivec2(INT16_MIN))) &&
+		glm::all(glm::lessThanEqual(turtle.maxBB, glm::ivec2(INT16_MAX))));
 
-	for (auto& v : verts) {
-		minBB = glm::min(minBB, v);
-		maxBB = glm::max(maxBB, v);
+	// Packed segments whenever they fit; strips can take fewer bytes, but
+	// need a first and count per strip on the host and a draw per strip
+	std::vector<PackedSegment> segs;
+	if (segPacking && lattice.packSegments(verts, segs)) {
+		const unsigned char* bytes = (const unsigned char*)segs.data();
+		p.data.assign(bytes, bytes + segs.size() * sizeof(PackedSegment));
+		p.count = segs.size();
+		p.type = GL_SHORT;
+		p.stride = sizeof(PackedSegment);
+		p.packed = true;
+		return;
 	}
-	glm::vec3 diag = maxBB - minBB;
-	float scale = 1.9f / glm::max(glm::max(diag.x, diag.y), diag.z);
-	id.bbfix = glm::mat4(1.0f);
-	id.bbfix[0][0] = scale;
-	id.bbfix[1][1] = scale;
-	id.bbfix[2][2] = scale;
-	id.bbfix[3] = glm::vec4(-(minBB + maxBB) * scale / 2.0f, 1.0f);
-	iterData.push_back(id);
-
-	GLsizei newSize = (id.first + id.count) * sizeof(glm::vec3);
-	if (newSize > bufSize) {
-		// Create a new vertex buffer to hold vertex data
-		GLuint tempBuf;
-		glGenBuffers(1, &tempBuf);
-		glBindBuffer(GL_ARRAY_BUFFER, tempBuf);
-		glBufferData(GL_ARRAY_BUFFER,
-			newSize, nullptr, GL_STATIC_DRAW);
-
-		// Copy data from existing buffer
-		if (vbo) {
-			glBindBuffer(GL_COPY_READ_BUFFER, vbo);
-			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ARRAY_BUFFER, 0, 0, bufSize);
-			glBindBuffer(GL_COPY_READ_BUFFER, 0);
-			glDeleteBuffers(1, &vbo);
+
+	if (strips)
+		p.joined = joinStrips(verts, p.starts);
+	p.count = verts.size();
+	p.packed = false;
+	if (narrow) {
+		p.data.resize(verts.size() * 2 * sizeof(int16_t));
+		int16_t* shorts = (int16_t*)p.data.data();
+		for (size_t i = 0; i < verts.size(); i++) {
+			shorts[2 * i] = (int16_t)verts[i].x;
+			shorts[2 * i + 1] = (int16_t)verts[i].y;
 		}
+		p.type = GL_SHORT;
+		p.stride = 2 * sizeof(int16_t);
+	} else {
+		const unsigned char* bytes = (const unsigned char*)verts.data();
+		p.data.assign(bytes, bytes + verts.size() * sizeof(glm::ivec2));
+		p.type = GL_INT;
+		p.stride = sizeof(glm::ivec2);
+	}
+}
 
-		vbo = tempBuf;
-		bufSize = newSize;
+// Append vertex data to the pages, cutting lines between segments and
+// repeating the cut vertex of strips
+void LSystem::upload(unsigned int iter, const void* data, uint64_t count, GLint size,
+	GLenum type, GLsizeiptr stride, const std::vector<uint64_t>& starts, bool packed) {
 
-	} else
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	bool lines = starts.empty() && !packed;
+	auto pieces = pages.append(data, count, stride, lines ? 2 : 1, starts.empty() ? 0 : 1);
+	store(iter, pieces, count, size, type, stride, starts, packed);
+}
 
-	// Upload new vertex data
-	glBufferSubData(GL_ARRAY_BUFFER,
-		id.first * sizeof(glm::vec3), id.count * sizeof(glm::vec3), verts.data());
+// Take the pieces as the iteration's parts and split the strips among them
+void LSystem::store(unsigned int iter, const std::vector<PagedBuffer::Piece>& pieces,
+	uint64_t count, GLint size, GLenum type, GLsizeiptr stride,
+	const std::vector<uint64_t>& starts, bool packed) {
+
+	IterData& id = iterData.at(iter);
+	id.built = true;
+	id.count = count;
+	id.size = size;
+	id.type = type;
+	id.packed = packed;
+	id.strips = starts.empty() ? 0 : starts.size() - 1;
+	id.bytes = count * stride;
+	id.parts.clear();
+
+	size_t strip = 0;
+	for (auto& piece : pieces) {
+		Part part;
+		part.piece = piece;
+		uint64_t end = piece.first + piece.count;
+		// Strips are in order; the one a piece ends in carries on in the next
+		while (strip < id.strips && starts[strip] < end) {
+			uint64_t first = std::max(starts[strip], piece.first);
+			uint64_t last = std::min(starts[strip + 1], end);
+			if (last - first >= 2) {
+				part.stripFirst.push_back((GLint)(first - piece.first));
+				part.stripCount.push_back((GLsizei)(last - first));
+			}
+			if (starts[strip + 1] > end)
+				break;
+			strip++;
+		}
+		id.parts.push_back(std::move(part));
+	}
 
 	// set vertex data source (format)
 	if (!vao) {
@@ -400,16 +1133,275 @@ void LSystem::addVerts(std::vector<glm::vec3>& verts) {
 	} */
 
 	glBindVertexArray(vao);
-
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
 	glEnableVertexAttribArray(0);
-	
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLvoid*)0);
-	
+	glBindVertexArray(0);
+}
+
+// Draw packed lattice segments as instanced two-vertex lines
+void LSystem::drawSegments(IterData& id, glm::mat4 xform) {
+	glm::vec2 units[6];
+	const auto& u = lattice.units();
+	for (size_t i = 0; i < 6; i++)
+		units[i] = i < u.size() ? glm::vec2(u[i]) : glm::vec2(0.0f);
+	glUseProgram(segShader);
+	glUniformMatrix4fv(segXformLoc, 1, GL_FALSE, glm::value_ptr(xform));
+	glUniform2fv(segUnitsLoc, 6, glm::value_ptr(units[0]));
+
+	if (!segVao) {
+		glGenVertexArrays(1, &segVao);
+		glBindVertexArray(segVao);
+		glEnableVertexAttribArray(0);
+		glEnableVertexAttribArray(1);
+		glVertexAttribDivisor(0, 1);
+		glVertexAttribDivisor(1, 1);
+	} else
+		glBindVertexArray(segVao);
+
+	// Start, then direction and run, of each segment in each page
+	for (auto& part : id.parts) {
+		GLintptr offset = part.piece.offset;
+		glBindBuffer(GL_ARRAY_BUFFER, part.piece.vbo);
+		glVertexAttribIPointer(0, 2, GL_SHORT, sizeof(PackedSegment), (GLvoid*)offset);
+		glVertexAttribIPointer(1, 2, GL_UNSIGNED_SHORT, sizeof(PackedSegment),
+			(GLvoid*)(offset + 2 * sizeof(int16_t)));
+		glDrawArraysInstanced(GL_LINES, 0, 2, part.piece.count);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glBindVertexArray(0);
+	glUseProgram(0);
+}
+
+// Instanced geometry of iteration N: every distinct block once, followed by
+// the start position and heading of each of its copies
+void LSystem::addInstances(unsigned int iter, BlockCache::Instances& inst) {
+	IterData& id = iterData.at(iter);
+	id.built = true;
+	id.parts.clear();
+	id.count = 0;
+	id.strips = 0;
+	id.deduped = 0;
+	id.merged = 0;
+	id.joined = 0;
+	id.packed = false;
+	id.basis = glm::mat4(1.0f);
+	id.groups = std::move(inst.groups);
+
+	GLsizeiptr vertBytes = inst.verts.size() * sizeof(glm::mat3);
+	GLsizeiptr frameBytes = inst.frames.size() * sizeof(glm::vec3);
+	id.bytes = vertBytes + frameBytes;
+	id.frameOffset = vertBytes;
+	glGenBuffers(1, &id.instVbo);
+	glBindBuffer(GL_ARRAY_BUFFER, id.instVbo);
+	glBufferData(GL_ARRAY_BUFFER, vertBytes + frameBytes, nullptr, GL_STATIC_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, vertBytes, inst.verts.data());
+	glBufferSubData(GL_ARRAY_BUFFER, vertBytes, frameBytes, inst.frames.data());
+
+	// Vertex matrix columns per vertex; frame attributes advance per instance
+	// and are pointed at each block's copies when drawing
+	glGenVertexArrays(1, &id.instVao);
+	glBindVertexArray(id.instVao);
+	for (GLuint col = 0; col < 3; col++) {
+		glEnableVertexAttribArray(col);
+		glVertexAttribPointer(col, 3, GL_FLOAT, GL_FALSE, sizeof(glm::mat3),
+			(GLvoid*)(col * sizeof(glm::vec3)));
+	}
+	for (GLuint attr = 3; attr < 5; attr++) {
+		glEnableVertexAttribArray(attr);
+		glVertexAttribDivisor(attr, 1);
+	}
+
 	glBindVertexArray(0);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
+// Scale and center the bounding box of iteration N to [-1,1]
+// The box comes from the cached subtree bounds when possible, and from a
+// pass over the vertices otherwise
+glm::mat4 LSystem::fitBounds(unsigned int iter, const std::vector<glm::vec3>& verts) {
+	glm::vec3 minBB, maxBB;
+	if (!predictBounds(iter, minBB, maxBB)) {
+		minBB = glm::vec3(std::numeric_limits<float>::max());
+		maxBB = glm::vec3(std::numeric_limits<float>::lowest());
+		for (auto& v : verts) {
+			minBB = glm::min(minBB, v);
+			maxBB = glm::max(maxBB, v);
+		}
+	}
+	return fitBox(minBB, maxBB);
+}
+
+// Scale and center a box to [-1,1]
+glm::mat4 LSystem::fitBox(glm::vec3 minBB, glm::vec3 maxBB) {
+	glm::vec3 diag = maxBB - minBB;
+	float scale = 1.9f / glm::max(glm::max(diag.x, diag.y), diag.z);
+	glm::mat4 bbfix(1.0f);
+	bbfix[0][0] = scale;
+	bbfix[1][1] = scale;
+	bbfix[2][2] = scale;
+	bbfix[3] = glm::vec4(-(minBB + maxBB) * scale / 2.0f, 1.0f);
+	return bbfix;
+}
+
+// Buffer use of a built iteration; removed vertices are counted at the size
+// they would have been stored at
+LSystem::BufferStats LSystem::getBufferStats(unsigned int iter) const {
+	BufferStats ret{ 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	if (!isBuilt(iter))
+		return ret;
+	const IterData& id = iterData[iter];
+	ret.verts = id.count;
+	ret.bytes = id.bytes;
+	ret.dupVerts = id.deduped;
+	ret.mergedVerts = id.merged;
+	ret.joinedVerts = id.joined;
+	ret.strips = id.strips;
+	if (id.count) {
+		ret.dupBytes = id.deduped * (id.bytes / id.count);
+		ret.mergedBytes = id.merged * (id.bytes / id.count);
+		ret.joinedBytes = id.joined * (id.bytes / id.count);
+	}
+	return ret;
+}
+
+// Change the vertex memory budget
+void LSystem::setBudget(uint64_t bytes) {
+	clearVerts();
+	budget = bytes;
+	maxIter = fitIterations();
+}
+
+// Worker settings; the worker must not see them change mid-job
+void LSystem::setThreads(unsigned int threads) {
+	settle();
+	numThreads = threads ? threads : 1;
+}
+
+void LSystem::setStreaming(bool stream) {
+	settle();
+	streaming = stream;
+}
+
+void LSystem::setMemoize(bool memo) {
+	settle();
+	memoize = memo;
+}
+
+void LSystem::setTasks(bool tasks) {
+	settle();
+	tasking = tasks;
+}
+
+void LSystem::setMerging(bool merge) {
+	settle();
+	merging = merge;
+}
+
+void LSystem::setStrips(bool join) {
+	settle();
+	strips = join;
+}
+
+void LSystem::setSegments(bool pack) {
+	settle();
+	segPacking = pack;
+}
+
+void LSystem::setDedup(bool drop) {
+	settle();
+	dedup = drop;
+}
+
+void LSystem::setDirect(bool write) {
+	settle();
+	direct = write;
+}
+
+// Switch the storage format of float vertices
+void LSystem::setVertexFormat(VertexFormat format) {
+	clearVerts();
+	vertexFormat = format;
+	maxIter = fitIterations();
+}
+
+// Switch the lattice turtle on or off
+void LSystem::setLattice(bool use) {
+	clearVerts();
+	useLattice = use;
+	maxIter = fitIterations();
+}
+
+// Switch between plain and instanced drawing
+void LSystem::setInstancing(unsigned int levels) {
+	clearVerts();
+	instancing = levels;
+	maxIter = fitIterations();
+}
+
+// Last iteration whose geometry fits in the budget, drawn the current way
+unsigned int LSystem::fitIterations() {
+	if (!instancing || !blocks.isValid())
+		return growth.maxIteration(budget, 2 * vertexSize(), MAX_ITER, false);
+
+	for (unsigned int iter = 0; iter <= MAX_ITER; iter++)
+		if (instancedSize(iter) > budget)
+			return iter ? iter - 1 : 0;
+	return MAX_ITER;
+}
+
+// Bytes of block vertex matrices and instance frames of iteration N, from
+// the symbol counts of the iteration the blocks are placed in
+uint64_t LSystem::instancedSize(unsigned int iter) {
+	unsigned int level = std::min(instancing, iter);
+	const std::string& alphabet = growth.getAlphabet();
+	std::vector<uint64_t> counts = growth.counts(iter - level);
+	uint64_t frames = 0, verts = 0;
+	bool segment = false;
+	for (size_t i = 0; i < alphabet.size(); i++) {
+		char ch = alphabet[i];
+		if (!counts[i])
+			continue;
+		if (ruleTable.hasRule(ch) && level > 0) {
+			uint64_t n = blocks.count(ch, level);
+			if (!n) continue;
+			verts += n;
+		} else if (Turtle::draws(ch))
+			segment = true;
+		else
+			continue;
+		// Counts saturate; anything this large is over budget anyway
+		if (counts[i] > budget || verts > budget)
+			return UINT64_MAX;
+		frames += counts[i];
+	}
+	if (segment)
+		verts += 2;
+	return verts * sizeof(glm::mat3) + frames * 2 * sizeof(glm::vec3);
+}
+
+// Bounding box of iteration N from the per-subtree turtle summaries
+bool LSystem::predictBounds(unsigned int iter, glm::vec3& minBB, glm::vec3& maxBB) {
+	std::lock_guard<std::mutex> guard(boundsLock);
+	if (!summaries.isValid())
+		return false;
+	return summaries.bounds(iter, minBB, maxBB);
+}
+
+// Forget the geometry of every iteration, keeping the buffer for reuse,
+// and cancel any being generated
+void LSystem::clearVerts() {
+	settle();
+	for (auto& id : iterData) {
+		id.built = false;
+		id.failed = false;
+		if (id.instVao) { glDeleteVertexArrays(1, &id.instVao); id.instVao = 0; }
+		if (id.instVbo) { glDeleteBuffers(1, &id.instVbo); id.instVbo = 0; }
+		id.groups.clear();
+		id.parts.clear();
+	}
+	pages.clear();
+}
+
 // Compile and link shader
 void LSystem::initShader() {
 	std::vector<GLuint> shaders;
@@ -423,6 +1415,25 @@ void LSystem::initShader() {
 
 	// Get uniform locations
 	xformLoc = glGetUniformLocation(shader, "xform");
+
+	// Same fragment shader for instanced drawing
+	shaders.push_back(compileShader(GL_VERTEX_SHADER, "shaders/vi.glsl"));
+	shaders.push_back(compileShader(GL_FRAGMENT_SHADER, "shaders/f.glsl"));
+	instShader = linkProgram(shaders);
+	for (auto s : shaders)
+		glDeleteShader(s);
+	shaders.clear();
+	instXformLoc = glGetUniformLocation(instShader, "xform");
+
+	// And for packed lattice segments
+	shaders.push_back(compileShader(GL_VERTEX_SHADER, "shaders/vs.glsl"));
+	shaders.push_back(compileShader(GL_FRAGMENT_SHADER, "shaders/f.glsl"));
+	segShader = linkProgram(shaders);
+	for (auto s : shaders)
+		glDeleteShader(s);
+	shaders.clear();
+	segXformLoc = glGetUniformLocation(segShader, "xform");
+	segUnitsLoc = glGetUniformLocation(segShader, "units");
 }
 
 
@@ -5,8 +5,25 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <glm/glm.hpp>
 #include "gl_core_3_3.h"
+#include "rules.hpp"
+#include "growth.hpp"
+#include "derivation.hpp"
+#include "summary.hpp"
+#include "blocks.hpp"
+#include "turtle.hpp"
+#include "branches.hpp"
+#include "lattice.hpp"
+#include "simplify.hpp"
+#include "packing.hpp"
+#include "pages.hpp"
+#include "spsc.hpp"
 
 class LSystem {
 public:
@@ -26,53 +43,340 @@ public:
 
 	// Generate next iteration
 	unsigned int iterate();
+	// Make iteration N drawable; its geometry is generated when it is first
+	// drawn, evicting the least recently drawn iterations to stay in budget
+	unsigned int jumpTo(unsigned int iter);
+	// Whether iteration N has all its geometry ready to draw
+	bool isBuilt(unsigned int iter) const {
+		return iter < iterData.size() && iterData[iter].built && !iterData[iter].growing; }
 
 	// Draw the L-System
+	// Iterations are generated by a background worker; until one is ready,
+	// the last iteration drawn is drawn in its place, and asking for another
+	// iteration cancels the generation of the one before
+	// Iterations written directly are drawn as their vertices arrive
 	void draw(glm::mat4 viewProj);
 	void drawIter(unsigned int iter, glm::mat4 viewProj, float line_width);
 
 	void update_time(float time);
 
+	// Settings read while generating; each waits for the worker to be idle,
+	// cancelling the iteration it was working on, which is asked for again
+	// the next time it is drawn
+
+	// Number of threads used to rewrite and interpret strings
+	void setThreads(unsigned int threads);
+	unsigned int getThreads() const {
+		return numThreads; }
+
 	// Data access
 	unsigned int getNumIter() const {
-		return strings.size(); }
-	std::string getString(unsigned int iter) const {
-		return strings.at(iter); }
+		return numIter; }
+	std::string getString(unsigned int iter) const;
+	// Random access into any iteration up to MAX_ITER, generated or not,
+	// without building its string
+	char getSymbol(unsigned int iter, uint64_t pos) const {
+		return derivation.at(iter, pos); }
+	std::string getSubstring(unsigned int iter, uint64_t begin, uint64_t end) const {
+		return derivation.substr(iter, begin, end); }
+
+	// Stream symbols straight from the derivation into the turtle instead of
+	// building the latest string (always done for strings over MAX_STRING)
+	void setStreaming(bool stream);
+	// Assemble geometry from cached subtree blocks when the rules allow it,
+	// instead of running the turtle over every symbol
+	void setMemoize(bool memo);
+	// With more than one thread, derive and draw the branches of bracketed
+	// grammars as parallel tasks instead of building strings (takes
+	// precedence over memoized blocks)
+	void setTasks(bool tasks);
+	// Draw grammars that stay on a square or hexagonal lattice with an exact
+	// integer turtle and integer vertices (takes precedence over the above)
+	// Changes getMaxIter, and drops all generated geometry
+	void setLattice(bool use);
+	bool getLattice() const {
+		return useLattice; }
+	// Merge runs of collinear segments before they go in the buffer
+	void setMerging(bool merge);
+	// Store float vertices in the given format (lattice vertices are always
+	// integers); changes getMaxIter, and drops all generated geometry
+	// FLOAT3 by default; the compact formats are lossy and must be chosen
+	void setVertexFormat(VertexFormat format);
+	VertexFormat getVertexFormat() const {
+		return vertexFormat; }
+	// Store connected segments as line strips, each shared vertex once,
+	// instead of separate vertex pairs
+	void setStrips(bool join);
+	// Store lattice segments in 8 bytes each (start, direction, run length)
+	// and expand them in the vertex shader, whenever the grammar stays on a
+	// lattice and its starts fit in 16 bits; on by default
+	void setSegments(bool pack);
+	// Drop segments drawn more than once before they go in the buffer
+	void setDedup(bool drop);
+	// Write the turtle's vertices straight into the buffer as the symbols
+	// are derived, without holding the iteration in host memory, when
+	// deduplication and merging are off or its vertices exceed MAX_HOST
+	// (neither pass is done then; strips are still joined), and draw them as
+	// they arrive; needs a predicted bounding box
+	void setDirect(bool write);
+	// Draw each distinct subtree levels steps deep once per copy with
+	// instancing instead of storing every vertex (0 turns it off)
+	// Changes getMaxIter, and drops all generated geometry
+	void setInstancing(unsigned int levels);
+	unsigned int getInstancing() const {
+		return instancing; }
+
+	// Size predictions, available as soon as the L-System is parsed
+	GrowthModel::Prediction predict(unsigned int iter) const {
+		return growth.predict(iter); }
+	// Last iteration whose geometry fits in the vertex budget by itself
+	unsigned int getMaxIter() const {
+		return maxIter; }
+	// Bytes of vertex memory to use for all iterations together; changes
+	// getMaxIter, and drops all generated geometry
+	void setBudget(uint64_t bytes);
+	uint64_t getBudget() const {
+		return budget; }
+	// Vertices and buffer bytes of a built iteration, and how many of each
+	// deduplication and collinear merging saved
+	struct BufferStats {
+		uint64_t verts;
+		uint64_t bytes;
+		uint64_t dupVerts;
+		uint64_t dupBytes;
+		uint64_t mergedVerts;
+		uint64_t mergedBytes;
+		uint64_t joinedVerts;
+		uint64_t joinedBytes;
+		uint64_t strips;
+	};
+	BufferStats getBufferStats(unsigned int iter) const;
+	// Bounding box of iteration N, computed without generating its geometry
+	// Returns false if it cannot be predicted or nothing is drawn
+	bool predictBounds(unsigned int iter, glm::vec3& minBB, glm::vec3& maxBB);
 
 private:
-	// Apply rules to a given string and return the result
-	std::string applyRules(std::string string);
-	// Create geometry for a given string and return the vertices
-	std::vector<glm::vec3> createGeometry(std::string string);
+	// Apply rules steps times to a given string and return the result
+	std::string applyRules(const std::string& string, unsigned int steps = 1);
+	// Create geometry for a given string, whose brackets nest at most nesting
+	// deep and which draws the given number of segments, and return the vertices
+	std::vector<glm::vec3> createGeometry(const std::string& string,
+		uint64_t nesting, uint64_t segments);
+	// Create geometry for an iteration without building its string
+	std::vector<glm::vec3> streamGeometry(unsigned int iter);
+	// Create geometry for any iteration, skipping the ones in between
+	std::vector<glm::vec3> generate(unsigned int iter);
+	// Whether iterations are drawn on the lattice
+	bool onLattice() const {
+		return useLattice && lattice.isValid(); }
+	// Largest size of one vertex in the current drawing mode
+	size_t vertexSize() const {
+		return onLattice() ? sizeof(glm::ivec2) : formatSize(vertexFormat, planar); }
+	// Last iteration that fits in the budget in the current drawing mode
+	unsigned int fitIterations();
+	// Buffer bytes needed to draw iteration N instanced
+	uint64_t instancedSize(unsigned int iter);
 
-	std::vector<std::string> strings;	// String representation of each iteration
+	unsigned int numIter;				// Number of iterations generated
+	Derivation derivation;				// History of all iterations
+	std::string latest;					// String of iteration latestIter; the worker
+										// writes it under jobLock
+	unsigned int latestIter;			// Iteration kept as a string, the same way
+	bool streaming;						// Skip building strings entirely
+	bool memoize;						// Assemble geometry from blocks
+	bool tasking;						// Draw branches as parallel tasks
+	bool useLattice;					// Use the lattice turtle when valid
+	bool merging;						// Merge collinear segments
+	bool dedup;							// Drop duplicate segments
+	bool strips;						// Join segments into line strips
+	bool segPacking;					// Allow packed lattice segments
+	bool direct;						// Write large iterations directly
+	VertexFormat vertexFormat;			// Storage of float vertices
+	bool planar;						// Grammar stays in the YZ plane
+	unsigned int instancing;			// Depth of instanced blocks, 0 if off
 	std::map<char, std::string> rules;	// Generation rules
+	RuleTable ruleTable;				// Rules compiled for rewriting
+	GrowthModel growth;					// Size predictor for the grammar
+	SummaryCache summaries;				// Turtle motion of each subtree
+	std::mutex boundsLock;				// Guards summaries, used by both threads
+	BlockCache blocks;					// Turtle geometry of each subtree
+	Turtle::Table turtleTable;			// Turtle opcodes for angle
+	BranchEngine branches;				// Parallel derivation of branches
+	Lattice lattice;					// Integer lattice of planar grammars
+	unsigned int maxIter;				// Last iteration that fits in the budget alone
 	float angle;						// Angle for rotations
+	unsigned int numThreads;			// Worker threads for rewriting and turtle
+
+	// One page's part of an iteration, with the strips that lie in it
+	struct Part {
+		PagedBuffer::Piece piece;			// Where the vertices are
+		std::vector<GLint> stripFirst;		// First vertex of each strip in the piece
+		std::vector<GLsizei> stripCount;	// Vertices in each strip, empty for lines
+	};
 
 	// Holds geometry data about each iteration
 	struct IterData {
-		GLint first;		// Starting index in vertex buffer
-		GLsizei count;		// Number of indices in iteration
-		glm::mat4 bbfix;	// Scale and rotate to [-1,1], centered at origin
+		bool built = false;			// Geometry is in the buffer
+		bool failed = false;		// Generation failed; not tried again
+		bool growing = false;		// Still being filled from the worker
+		std::vector<Part> parts;	// Pieces of the vertices, one per page
+		uint64_t count = 0;			// Number of indices in iteration
+		GLint size = 0;				// Components per vertex
+		GLenum type = 0;			// Component type
+		uint64_t deduped = 0;		// Vertices removed as duplicates
+		uint64_t merged = 0;		// Vertices removed by merging
+		uint64_t joined = 0;		// Vertices removed by joining strips
+		uint64_t strips = 0;		// Number of strips, 0 for lines
+		bool packed = false;		// Holds packed segments rather than vertices
+		uint64_t lastUse = 0;		// Value of useClock when last drawn
+		uint64_t bytes = 0;			// Bytes of vertices in the buffer
+		glm::mat4 basis{ 1.0f };	// Vertex coordinates to world space
+		glm::mat4 bbfix{ 1.0f };	// Scale and rotate to [-1,1], centered at origin
+		GLuint instVao = 0;			// Vertex array for instanced drawing
+		GLuint instVbo = 0;			// Block vertex matrices, then instance frames
+		GLsizeiptr frameOffset = 0;	// Byte offset of the frames in instVbo
+		std::vector<BlockCache::Instances::Group> groups;	// Instanced draws
 	};
 
+	// Geometry of an iteration generated off the GL thread, ready to upload
+	struct Prepared {
+		unsigned int iter;					// Iteration generated
+		uint64_t ticket;					// Job that generated it
+		uint64_t fill;						// Pass its chunks belong to, if progressive
+		std::string error;					// Why generation failed, if it did
+		uint64_t bytes;						// Predicted buffer bytes, for eviction
+		std::vector<unsigned char> data;	// Vertices or packed segments
+		uint64_t count;						// Elements in data
+		GLint size;							// Components per vertex
+		GLenum type;						// Component type
+		GLsizeiptr stride;					// Bytes per element
+		std::vector<uint64_t> starts;		// Strip starts, empty for lines
+		bool packed;						// Holds packed segments
+		uint64_t deduped;					// Vertices removed as duplicates
+		uint64_t merged;					// Vertices removed by merging
+		uint64_t joined;					// Vertices removed by joining strips
+		glm::mat4 basis;					// Vertex coordinates to world space
+		glm::mat4 bbfix;					// Scale and rotate to [-1,1]
+		bool instanced;						// Holds inst instead of data
+		BlockCache::Instances inst;			// Instanced blocks and frames
+		bool progressive;					// Vertices come as chunks instead of data
+	};
+	// A block of packed vertices on its way from the worker to the pages
+	struct Chunk {
+		uint64_t fill;						// Pass of the job it belongs to
+		std::vector<unsigned char> data;	// Packed vertices
+		uint64_t count;						// Vertices in data
+		std::vector<uint64_t> starts;		// Strips starting in data, counted from
+											// the start of the iteration
+	};
+	// Progressive iteration being filled from the chunks (GL thread)
+	struct Filling {
+		bool active;						// An iteration is being filled
+		unsigned int iter;					// Which one
+		uint64_t ticket;					// Job filling it
+		uint64_t fill;						// Pass of the job whose chunks it takes
+		uint64_t count;						// Vertices written so far
+		GLint size;							// Components per vertex
+		GLenum type;						// Component type
+		GLsizeiptr stride;					// Bytes per vertex
+		bool open;							// A strip has started
+		uint64_t openFirst;					// First vertex of the last strip started
+		size_t openPart;					// Part that vertex is in
+		std::vector<size_t> openIn;			// Parts drawing the last strip so far
+	};
+	// Thrown by checkCancel when the job being worked on is outdated
+	struct Cancelled {};
+
 	float cur_time;
 	GLuint time_uniform_loc;
 	float rot;
 	float line_width;
 
 	// OpenGL state
-	static const GLsizei MAX_BUF = 1 << 26;		// Maximum buffer size
+	static const uint64_t DEFAULT_BUDGET = 1 << 28;	// Default vertex memory budget
+	static const unsigned int MAX_ITER = 64;	// Upper limit on maxIter
+	static const uint64_t MAX_STRING = 1 << 28;	// Longest string to build
+	static const uint64_t MAX_HOST = 1 << 26;	// Most vertex bytes to hold in host memory
 	GLuint vao;							// Vertex array object
-	GLuint vbo;							// Vertex buffer
+	GLuint segVao;						// Vertex array for packed segments
 	std::vector<IterData> iterData;		// Iteration data
-	GLsizei bufSize;					// Current size of the buffer
-	void addVerts(std::vector<glm::vec3>& verts);	// Add iter geometry to buffer
+	PagedBuffer pages;					// Vertex storage of all iterations
+	uint64_t budget;					// Most vertex bytes to keep
+	uint64_t useClock;					// Counts draws, for eviction order
+	unsigned int shown;					// Last iteration drawn
+	void build(unsigned int iter);		// Request or upload iter geometry
+	void evict(unsigned int iter);		// Drop iter geometry
+	void makeRoom(unsigned int iter, uint64_t bytes);	// Evict until bytes fit
+	uint64_t residentBytes() const;		// GPU memory held by all iterations
+	void prepare(Prepared& p);			// Generate iter geometry (worker)
+	void finish(Prepared& p);			// Upload generated geometry
+	void prepareVerts(Prepared& p, std::vector<glm::vec3>& verts);	// Process and pack vertices
+	void prepareLattice(Prepared& p);	// Generate lattice geometry
+	bool writesDirect(unsigned int iter) const;	// Whether iter goes straight to the pages
+	bool prepareDirect(Prepared& p);	// Send iter geometry as it is generated (worker)
+	bool streamDirect(Prepared& p, glm::vec3& lo, glm::vec3& hi);	// One pass of it
+	void pushChunk(Chunk& chunk);		// Queue a chunk, waiting for room (worker)
+	void startFilling(Prepared& p);		// Open a progressive iteration
+	void drainChunks();					// Write queued chunks and show them
+	void growParts(const std::vector<PagedBuffer::Piece>& pieces);	// Follow the open allocation
+	void splitStrip(uint64_t first, uint64_t last, bool open);	// Add a strip to the parts
+	void stopFilling(bool cancel = true);	// Drop the progressive iteration
+	// Append count vertices (or packed segments) of stride bytes to the
+	// pages as iteration N; starts lists the strips, if any
+	void upload(unsigned int iter, const void* data, uint64_t count, GLint size, GLenum type,
+		GLsizeiptr stride, const std::vector<uint64_t>& starts, bool packed);
+	// Record pieces already in the pages as iteration N
+	void store(unsigned int iter, const std::vector<PagedBuffer::Piece>& pieces, uint64_t count,
+		GLint size, GLenum type, GLsizeiptr stride, const std::vector<uint64_t>& starts, bool packed);
+	void addInstances(unsigned int iter, BlockCache::Instances& inst);	// Upload instanced iter geometry
+	void drawInstances(IterData& id, glm::mat4 xform);	// Draw instanced iter
+	void drawSegments(IterData& id, glm::mat4 xform);	// Draw packed segments
+	void clearVerts();					// Drop the geometry of all iterations
+	glm::mat4 fitBounds(unsigned int iter, const std::vector<glm::vec3>& verts);
+	static glm::mat4 fitBox(glm::vec3 minBB, glm::vec3 maxBB);
+
+	// Background generation; the worker prepares one job at a time and the
+	// GL thread picks up its result when drawing
+	static const uint64_t CANCEL_BLOCK = 1 << 22;	// Symbols per thread between cancellation checks
+	static const size_t CHUNK_BYTES = 1 << 18;	// Packed vertex bytes per chunk
+	static const size_t MAX_CHUNKS = 64;		// Chunks queued at most
+	std::thread worker;					// Runs work(), started on first request
+	mutable std::mutex jobLock;			// Guards everything below but ticket
+	std::condition_variable jobSignal;	// New job, finished job or quit
+	bool hasJob;						// A job is waiting for the worker
+	bool busy;							// The worker is preparing a job
+	bool quit;							// The worker should exit
+	unsigned int jobIter;				// Iteration of the latest job
+	uint64_t jobTicket;					// Ticket of the waiting job
+	std::unique_ptr<Prepared> result;	// Finished job waiting for upload
+	std::unique_ptr<Prepared> opening;	// Progressive job whose chunks follow
+	SpscQueue<Chunk> chunks;			// Vertices from the worker, in order
+	Filling filling;					// Where the chunks go
+	std::atomic<uint64_t> accepted;		// Pass whose chunks the GL thread takes
+	uint64_t fills;						// Passes started (worker)
+	std::atomic<uint64_t> ticket;		// Latest request; older jobs are outdated
+	uint64_t working;					// Ticket of the job being prepared (worker)
+	void work();						// Worker loop
+	void checkCancel() const;			// Throw Cancelled if the job is outdated
+	bool cancelled() const;				// Whether the job is outdated
+	void settle();						// Cancel any job and wait for the worker
+	void stopWorker();					// Cancel any job and end the worker
+
+	// Moves take from an LSystem whose worker has ended; stopped() ends it
+	// before the tagged constructor reads any member
+	struct Stopped {};
+	static Stopped stopped(LSystem& other);
+	LSystem(LSystem&& other, Stopped);
 
 	// Shared OpenGL state (shader)
 	static unsigned int refcount;		// Reference counter
 	static GLuint shader;				// Shader program
 	static GLuint xformLoc;				// Location of matrix uniform
+	static GLuint instShader;			// Instanced shader program
+	static GLuint instXformLoc;			// Location of its matrix uniform
+	static GLuint segShader;			// Packed segment shader program
+	static GLuint segXformLoc;			// Location of its matrix uniform
+	static GLuint segUnitsLoc;			// Location of its direction table
 	void initShader();					// Create the shader program
 };
 
@@ -12,8 +12,12 @@ const int MENU_OBJBASE = 64;				// Select L-System to view
 const int MENU_PREVITER = 2;				// Show previous iteration
 const int MENU_NEXTITER = 3;				// Show next iteration
 const int MENU_REPARSE = 4;					// Re-parse the last loaded file
+const int MENU_INSTANCING = 5;				// Cycle the instancing level
+const int MENU_LATTICE = 6;					// Toggle integer lattice geometry
+const int MENU_FORMAT = 7;					// Cycle the vertex format
 const int MENU_EXIT = 1;					// Exit application
 std::vector<std::string> modelFilenames;	// Paths to L-System files to load
+const unsigned int MAX_INSTANCING = 6;		// Deepest instanced blocks offered
 
 // OpenGL state
 int width, height;
@@ -21,6 +25,7 @@ std::unique_ptr<LSystem> lsystem;
 unsigned int iter = 0;
 std::string lastFilename;
 int lastFilenameIdx = -1;
+bool reported = false;						// Buffer use of iter has been printed
 
 // Initialization functions
 void initGLUT(int* argc, char** argv);
@@ -39,6 +44,10 @@ void idle();
 void menu(int cmd);
 void cleanup();
 
+// Report the displayed iteration, and its buffer use once it is built
+void printIter();
+void printStats();
+
 // Program entry point
 int main(int argc, char** argv) {
 	std::string configFile = "models/tree1.txt";
@@ -68,7 +77,7 @@ int main(int argc, char** argv) {
 				}
 
 				iter = lsystem->getNumIter() - 1;
-				std::cout << "Iteration " << iter << std::endl;
+				printIter();
 			}
 		} catch (const std::exception& e) {
 			std::cerr << "Parse error: " << e.what() << std::endl;
@@ -127,6 +136,9 @@ void initMenu() {
 	glutAddMenuEntry("Prev iter", MENU_PREVITER);
 	glutAddMenuEntry("Next iter", MENU_NEXTITER);
 	glutAddMenuEntry("Reparse", MENU_REPARSE);
+	glutAddMenuEntry("Instancing level", MENU_INSTANCING);
+	glutAddMenuEntry("Lattice geometry", MENU_LATTICE);
+	glutAddMenuEntry("Vertex format", MENU_FORMAT);
 	glutAddMenuEntry("Exit", MENU_EXIT);
 	glutAttachMenu(GLUT_RIGHT_BUTTON);
 
@@ -159,6 +171,9 @@ void display() {
 		}else{
 			lsystem->drawIter(iter, proj, 1.0f);
 		}
+	// Iterations are generated in the background and built between frames
+	if (lsystem && !reported && lsystem->isBuilt(iter))
+		printStats();
 		
 
 	// Scene is rendered to the back buffer, so swap the buffers to display it
@@ -178,6 +193,15 @@ void keyPress(unsigned char key, int x, int y) {
 	case ' ':
 		menu(MENU_REPARSE);
 		break;
+	case 'i':
+		menu(MENU_INSTANCING);
+		break;
+	case 'l':
+		menu(MENU_LATTICE);
+		break;
+	case 'v':
+		menu(MENU_FORMAT);
+		break;
 	}
 }
 
@@ -250,20 +274,30 @@ void menu(int cmd) {
 	// Display previous iteration
 	case MENU_PREVITER:
 		if (iter != 0) {
-			iter--;
-			std::cout << "Iteration " << iter << std::endl;
-			glutPostRedisplay();
+			try {
+				lsystem->jumpTo(iter - 1);
+				iter--;
+				printIter();
+				glutPostRedisplay();
+			} catch (const std::exception& e) {
+				std::cerr << "Too many iterations: " << e.what() << std::endl;
+			}
 		}
 		break;
 
 	// Display next iteration
 	case MENU_NEXTITER:
 		if (!lsystem->getNumIter()) break;
+		if (iter + 1 > lsystem->getMaxIter()) {
+			std::cerr << "Too many iterations: iteration " << iter + 1
+				<< " exceeds maximum buffer size" << std::endl;
+			break;
+		}
 		try {
-			if (iter + 1 >= lsystem->getNumIter())
-				lsystem->iterate();
+			// Only the iteration being shown gets geometry
+			lsystem->jumpTo(iter + 1);
 			iter++;
-			std::cout << "Iteration " << iter << std::endl;
+			printIter();
 			glutPostRedisplay();
 		} catch (const std::exception& e) {
 			std::cerr << "Too many iterations: " << e.what() << std::endl;
@@ -276,7 +310,7 @@ void menu(int cmd) {
 			try {
 				lsystem->parseFile(lastFilename);
 				iter = lsystem->getNumIter() - 1;
-				std::cout << "Iteration " << iter << std::endl;
+				printIter();
 				glutPostRedisplay();
 			} catch (const std::exception& e) {
 				std::cerr << "Parse error: " << e.what() << std::endl;
@@ -284,6 +318,53 @@ void menu(int cmd) {
 		}
 		break;
 
+	// Draw deeper blocks instanced, wrapping around to plain lines
+	case MENU_INSTANCING:
+		if (!lsystem->getNumIter()) break;
+		lsystem->setInstancing((lsystem->getInstancing() + 1) % (MAX_INSTANCING + 1));
+		std::cout << "Instancing level " << lsystem->getInstancing() << std::endl;
+		try {
+			iter = std::min(iter, lsystem->getMaxIter());
+			lsystem->jumpTo(iter);
+			printIter();
+			glutPostRedisplay();
+		} catch (const std::exception& e) {
+			std::cerr << "Too many iterations: " << e.what() << std::endl;
+		}
+		break;
+
+	// Switch between integer lattice and float vertices
+	case MENU_LATTICE:
+		if (!lsystem->getNumIter()) break;
+		lsystem->setLattice(!lsystem->getLattice());
+		std::cout << "Lattice geometry " << (lsystem->getLattice() ? "on" : "off") << std::endl;
+		try {
+			iter = std::min(iter, lsystem->getMaxIter());
+			lsystem->jumpTo(iter);
+			printIter();
+			glutPostRedisplay();
+		} catch (const std::exception& e) {
+			std::cerr << "Too many iterations: " << e.what() << std::endl;
+		}
+		break;
+
+	// Store float vertices in the next format, wrapping around
+	case MENU_FORMAT: {
+		if (!lsystem->getNumIter()) break;
+		int next = ((int)lsystem->getVertexFormat() + 1) % (int)VertexFormat::NUM_FORMATS;
+		lsystem->setVertexFormat((VertexFormat)next);
+		std::cout << "Vertex format " << formatName(lsystem->getVertexFormat()) << std::endl;
+		try {
+			iter = std::min(iter, lsystem->getMaxIter());
+			lsystem->jumpTo(iter);
+			printIter();
+			glutPostRedisplay();
+		} catch (const std::exception& e) {
+			std::cerr << "Too many iterations: " << e.what() << std::endl;
+		}
+		break;
+	}
+
 	default:
 		// Show the other objects
 		if (cmd >= MENU_OBJBASE) {
@@ -292,7 +373,7 @@ void menu(int cmd) {
 				lastFilename = modelFilenames[cmd - MENU_OBJBASE];
 				lastFilenameIdx = cmd - MENU_OBJBASE;
 				iter = lsystem->getNumIter() - 1;
-				std::cout << "Iteration " << iter << std::endl;
+				printIter();
 				glutPostRedisplay();	// Request redraw
 			} catch (const std::exception& e) {
 				std::cerr << "Parse error: " << e.what() << std::endl;
@@ -302,6 +383,35 @@ void menu(int cmd) {
 	}
 }
 
+// Print the current iteration along with the largest one that can be shown
+void printIter() {
+	auto p = lsystem->predict(iter);
+	std::cout << "Iteration " << iter << " of " << lsystem->getMaxIter()
+		<< " (" << p.length << " symbols, " << p.segments << " segments)" << std::endl;
+	reported = false;
+	if (lsystem->isBuilt(iter))
+		printStats();
+}
+
+// Print how the displayed iteration is stored
+void printStats() {
+	reported = true;
+	auto b = lsystem->getBufferStats(iter);
+	if (b.bytes) {
+		std::cout << "  " << b.verts << " vertices, " << b.bytes << " bytes in buffer";
+		if (b.dupVerts)
+			std::cout << " (deduplication saved " << b.dupVerts << " vertices, "
+				<< b.dupBytes << " bytes)";
+		if (b.mergedVerts)
+			std::cout << " (merging saved " << b.mergedVerts << " vertices, "
+				<< b.mergedBytes << " bytes)";
+		if (b.strips)
+			std::cout << " (" << b.strips << " strips saved " << b.joinedVerts << " vertices, "
+				<< b.joinedBytes << " bytes)";
+		std::cout << std::endl;
+	}
+}
+
 // Called when the window is closed or the event loop is otherwise exited
 void cleanup() {
 	lsystem.reset(nullptr);
@@ -0,0 +1,144 @@
+#include "packing.hpp"
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <glm/gtc/packing.hpp>
+
+// Largest 16-bit integer coordinate
+static const float SHORT_MAX = 32767.0f;
+
+// Round a box-relative coordinate to a 16-bit integer
+static int16_t toShort(float x) {
+	return (int16_t)std::lround(glm::clamp(x, -1.0f, 1.0f) * SHORT_MAX);
+}
+
+// Center and half extent of the box; flat axes get a half extent of 1 so
+// nothing divides by 0
+VertexPacker::VertexPacker(VertexFormat format, glm::vec3 minBB, glm::vec3 maxBB,
+	bool planar) :
+	format(format) {
+
+	glm::vec3 half = 0.5f * (maxBB - minBB);
+	center = 0.5f * (minBB + maxBB);
+	for (int i = 0; i < 3; i++)
+		if (!(half[i] > 0.0f))
+			half[i] = 1.0f;
+	inv = 1.0f / half;
+	if (format == VertexFormat::SHORT2 && !planar)
+		this->format = VertexFormat::SHORT3;
+
+	basis = glm::mat4(1.0f);
+	switch (this->format) {
+	case VertexFormat::FLOAT3:
+		size = 3;
+		type = GL_FLOAT;
+		bytes = sizeof(glm::vec3);
+		return;
+	case VertexFormat::HALF3:
+		size = 3;
+		type = GL_HALF_FLOAT;
+		bytes = 3 * sizeof(uint16_t);
+		for (int i = 0; i < 3; i++)
+			basis[i][i] = half[i];
+		break;
+	case VertexFormat::SHORT3:
+		size = 3;
+		type = GL_SHORT;
+		bytes = 3 * sizeof(int16_t);
+		for (int i = 0; i < 3; i++)
+			basis[i][i] = half[i] / SHORT_MAX;
+		break;
+	default:
+		// Stored (y, z) becomes world (0, y, z)
+		size = 2;
+		type = GL_SHORT;
+		bytes = 2 * sizeof(int16_t);
+		basis = glm::mat4(0.0f);
+		basis[0][1] = half.y / SHORT_MAX;
+		basis[1][2] = half.z / SHORT_MAX;
+		basis[2][0] = 1.0f;
+		break;
+	}
+	basis[3] = glm::vec4(center, 1.0f);
+}
+
+// Half a step of the 16-bit grid
+glm::vec3 VertexPacker::slack() const {
+	return 0.5f / (inv * SHORT_MAX);
+}
+
+// Convert one vertex relative to the box
+void VertexPacker::pack(const glm::vec3& v, unsigned char* out) const {
+	if (format == VertexFormat::FLOAT3) {
+		std::memcpy(out, &v, sizeof(glm::vec3));
+		return;
+	}
+	glm::vec3 r = (v - center) * inv;
+	if (format == VertexFormat::HALF3) {
+		uint16_t h[3] = { glm::packHalf1x16(r.x), glm::packHalf1x16(r.y), glm::packHalf1x16(r.z) };
+		std::memcpy(out, h, sizeof(h));
+	} else if (format == VertexFormat::SHORT3) {
+		int16_t s[3] = { toShort(r.x), toShort(r.y), toShort(r.z) };
+		std::memcpy(out, s, sizeof(s));
+	} else {
+		int16_t s[2] = { toShort(r.y), toShort(r.z) };
+		std::memcpy(out, s, sizeof(s));
+	}
+}
+
+// Box of the vertices, and whether they lie in the YZ plane, where 2D
+// grammars keep x exactly 0; then every vertex through a packer
+PackedVerts packVerts(const std::vector<glm::vec3>& verts, VertexFormat format) {
+	glm::vec3 minBB(std::numeric_limits<float>::max());
+	glm::vec3 maxBB(std::numeric_limits<float>::lowest());
+	bool planar = true;
+	for (auto& v : verts) {
+		minBB = glm::min(minBB, v);
+		maxBB = glm::max(maxBB, v);
+		planar = planar && v.x == 0.0f;
+	}
+	if (verts.empty())
+		minBB = maxBB = glm::vec3(0.0f);
+
+	VertexPacker packer(format, minBB, maxBB, planar);
+	PackedVerts ret;
+	ret.data.resize(verts.size() * packer.stride());
+	unsigned char* out = ret.data.data();
+	for (auto& v : verts) {
+		packer.pack(v, out);
+		out += packer.stride();
+	}
+	ret.size = packer.size;
+	ret.type = packer.type;
+	ret.basis = packer.basis;
+	return ret;
+}
+
+// Bytes per vertex
+size_t formatSize(VertexFormat format, bool planar) {
+	switch (format) {
+	case VertexFormat::HALF3:
+	case VertexFormat::SHORT3:
+		return 3 * sizeof(int16_t);
+	case VertexFormat::SHORT2:
+		return (planar ? 2 : 3) * sizeof(int16_t);
+	default:
+		return sizeof(glm::vec3);
+	}
+}
+
+// Short display names
+const char* formatName(VertexFormat format) {
+	switch (format) {
+	case VertexFormat::FLOAT3:
+		return "float3";
+	case VertexFormat::HALF3:
+		return "half3";
+	case VertexFormat::SHORT3:
+		return "int16x3";
+	case VertexFormat::SHORT2:
+		return "int16x2";
+	default:
+		return "unknown";
+	}
+}
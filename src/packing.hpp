@@ -0,0 +1,66 @@
+#ifndef PACKING_HPP
+#define PACKING_HPP
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "gl_core_3_3.h"
+
+// Storage formats for line vertices
+// The compact formats store coordinates relative to the bounding box of the
+// vertices, and the basis of the packed result maps them back to world space
+enum class VertexFormat {
+	FLOAT3,		// 32-bit floats, 12 bytes
+	HALF3,		// 16-bit floats in [-1,1] over the box, 6 bytes
+	SHORT3,		// 16-bit integers in [-32767,32767] over the box, 6 bytes
+	SHORT2,		// Same as SHORT3 for geometry in the YZ plane, 4 bytes
+	NUM_FORMATS
+};
+
+// Vertices ready for the buffer, with the attribute layout to draw them
+struct PackedVerts {
+	std::vector<unsigned char> data;	// Vertex data
+	GLint size;							// Components per vertex
+	GLenum type;						// Component type
+	glm::mat4 basis;					// Stored coordinates to world space
+};
+
+// Converts vertices one at a time, over a bounding box known in advance
+class VertexPacker {
+public:
+	// Pack in the given format over the box; SHORT2 falls back to SHORT3
+	// unless the geometry is planar
+	VertexPacker(VertexFormat format, glm::vec3 minBB, glm::vec3 maxBB, bool planar);
+
+	// Write one vertex of stride() bytes to out
+	void pack(const glm::vec3& v, unsigned char* out) const;
+
+	// Bytes per vertex, the attribute layout and the basis undoing the packing
+	size_t stride() const {
+		return bytes; }
+	// Whether vertices outside the box are clamped onto it, and how far out
+	// one can be and still round to the face
+	bool clamps() const {
+		return format == VertexFormat::SHORT3 || format == VertexFormat::SHORT2; }
+	glm::vec3 slack() const;
+	GLint size;							// Components per vertex
+	GLenum type;						// Component type
+	glm::mat4 basis;					// Stored coordinates to world space
+
+private:
+	VertexFormat format;				// Format after the planar fallback
+	glm::vec3 center;					// Box center
+	glm::vec3 inv;						// Inverse half extent of the box
+	size_t bytes;						// Bytes per vertex
+};
+
+// Pack vertices in the given format; SHORT2 falls back to SHORT3 for
+// geometry that leaves the YZ plane
+PackedVerts packVerts(const std::vector<glm::vec3>& verts, VertexFormat format);
+// Largest size of one vertex in a format, given whether all geometry lies in
+// the YZ plane
+size_t formatSize(VertexFormat format, bool planar);
+// Name of a format for display
+const char* formatName(VertexFormat format);
+
+#endif
@@ -0,0 +1,334 @@
+#include "pages.hpp"
+#include <algorithm>
+#include <utility>
+#include <cstring>
+#include <stdexcept>
+
+// Offsets of new pieces are kept aligned for every vertex format
+static const GLsizeiptr ALIGN = 16;
+// Nanoseconds to wait on a staging fence before flushing again
+static const GLuint64 WAIT_NS = 1000000;
+
+// No pages until something is stored
+PagedBuffer::PagedBuffer() :
+	current(0),
+	fill(0),
+	usedBytes(0),
+	next(0),
+	writer() {}
+
+// Delete all pages
+PagedBuffer::~PagedBuffer() {
+	release();
+}
+
+// Take other's pages
+PagedBuffer::PagedBuffer(PagedBuffer&& other) :
+	pages(std::move(other.pages)),
+	spares(std::move(other.spares)),
+	current(other.current),
+	fill(other.fill),
+	usedBytes(other.usedBytes),
+	stages(std::move(other.stages)),
+	next(other.next),
+	writer(std::move(other.writer)) {
+
+	other.pages.clear();
+	other.spares.clear();
+	other.stages.clear();
+	other.writer = Writer();
+	other.current = 0;
+	other.fill = 0;
+	other.usedBytes = 0;
+}
+
+// Release our pages and take other's
+PagedBuffer& PagedBuffer::operator=(PagedBuffer&& other) {
+	if (this != &other) {
+		release();
+		pages = std::move(other.pages);
+		spares = std::move(other.spares);
+		current = other.current;
+		fill = other.fill;
+		usedBytes = other.usedBytes;
+		stages = std::move(other.stages);
+		next = other.next;
+		writer = std::move(other.writer);
+		other.pages.clear();
+		other.spares.clear();
+		other.stages.clear();
+		other.writer = Writer();
+		other.current = 0;
+		other.fill = 0;
+		other.usedBytes = 0;
+	}
+	return *this;
+}
+
+// Write everything as one allocation
+std::vector<PagedBuffer::Piece> PagedBuffer::append(const void* data, uint64_t count,
+	GLsizeiptr stride, uint64_t unit, uint64_t overlap) {
+
+	begin(stride, unit, overlap);
+	write(data, count);
+	return end();
+}
+
+// Nothing is placed until the first element is written
+void PagedBuffer::begin(GLsizeiptr stride, uint64_t unit, uint64_t overlap) {
+	writer = Writer();
+	writer.stride = stride;
+	writer.unit = unit;
+	writer.overlap = overlap;
+	writer.tail.reserve(overlap * stride);
+}
+
+// Stage as much as the open piece takes, starting a new piece whenever it
+// is full, and keep the last overlap elements for the piece after it
+void PagedBuffer::write(const void* data, uint64_t count) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	GLsizeiptr stride = writer.stride;
+	while (count) {
+		if (writer.pieces.empty() || !writer.room) {
+			openPiece();
+			continue;
+		}
+		uint64_t n = stage(bytes, count);
+		writer.written += n;
+		uint64_t keep = std::min(n, writer.overlap);
+		if (keep) {
+			auto& tail = writer.tail;
+			tail.insert(tail.end(), bytes + (n - keep) * stride, bytes + n * stride);
+			if (tail.size() > writer.overlap * stride)
+				tail.erase(tail.begin(), tail.end() - writer.overlap * stride);
+		}
+		bytes += n * stride;
+		count -= n;
+	}
+}
+
+// Finish the last piece and hand all of them over
+std::vector<PagedBuffer::Piece> PagedBuffer::end() {
+	if (!writer.pieces.empty())
+		closePiece();
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	std::vector<Piece> ret = std::move(writer.pieces);
+	writer = Writer();
+	return ret;
+}
+
+// The last piece stays open; later writes continue where the copy ended
+const std::vector<PagedBuffer::Piece>& PagedBuffer::progress() {
+	flushStage();
+	return writer.pieces;
+}
+
+// Fit as many whole units as the current page has room for, moving on to
+// the next page if that is not enough to get past the repeated overlap
+void PagedBuffer::openPiece() {
+	bool first = writer.pieces.empty();
+	if (!first)
+		closePiece();
+	while (true) {
+		if (current == pages.size()) {
+			nextPage();
+			continue;
+		}
+		uint64_t space = (uint64_t)(PAGE_SIZE - fill) / writer.stride;
+		writer.room = space / writer.unit * writer.unit;
+		if (writer.room && (first || writer.room > writer.overlap))
+			break;
+		nextPage();
+	}
+	uint64_t repeat = first ? 0 : writer.overlap;
+	writer.pieces.push_back({ pages[current].vbo, current, fill, writer.written - repeat, 0, 0 });
+	writer.dest = fill;
+
+	// The elements the previous piece ended with begin this one
+	const unsigned char* bytes = writer.tail.data();
+	while (repeat) {
+		uint64_t n = stage(bytes, repeat);
+		bytes += n * writer.stride;
+		repeat -= n;
+	}
+}
+
+// Copy out what is staged for the piece, and count its bytes as stored
+void PagedBuffer::closePiece() {
+	flushStage();
+	Piece& piece = writer.pieces.back();
+	pages[piece.page].live += piece.bytes;
+	usedBytes += piece.bytes;
+	fill = std::min(PAGE_SIZE, (piece.offset + piece.bytes + ALIGN - 1) / ALIGN * ALIGN);
+	writer.room = 0;
+}
+
+// Copy up to count elements into the mapped stage, as many as it and the
+// open piece have room for, flushing a full stage first
+uint64_t PagedBuffer::stage(const unsigned char* data, uint64_t count) {
+	GLsizeiptr stride = writer.stride;
+	if (writer.mapped && writer.staged + stride > STAGE_SIZE)
+		flushStage();
+	if (!writer.mapped)
+		mapStage();
+	uint64_t n = std::min({ count, writer.room, (uint64_t)((STAGE_SIZE - writer.staged) / stride) });
+	std::memcpy(writer.mapped + writer.staged, data, n * stride);
+	writer.staged += n * stride;
+	writer.room -= n;
+	Piece& piece = writer.pieces.back();
+	piece.count += (GLsizei)n;
+	piece.bytes += n * stride;
+	return n;
+}
+
+// Create the ring on first use, and wait until the GPU has copied out what
+// was last staged here before writing over it
+void PagedBuffer::mapStage() {
+	if (stages.empty()) {
+		stages.resize(NUM_STAGES, Stage{ 0, 0 });
+		for (auto& s : stages) {
+			glGenBuffers(1, &s.vbo);
+			glBindBuffer(GL_COPY_READ_BUFFER, s.vbo);
+			glBufferData(GL_COPY_READ_BUFFER, STAGE_SIZE, nullptr, GL_STREAM_COPY);
+		}
+		next = 0;
+	}
+	Stage& s = stages[next];
+	if (s.fence) {
+		GLenum status = glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT, WAIT_NS);
+		while (status == GL_TIMEOUT_EXPIRED)
+			status = glClientWaitSync(s.fence, 0, WAIT_NS);
+		glDeleteSync(s.fence);
+		s.fence = 0;
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, s.vbo);
+	writer.mapped = (unsigned char*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, STAGE_SIZE,
+		GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_FLUSH_EXPLICIT_BIT);
+	if (!writer.mapped)
+		throw std::runtime_error("failed to map staging buffer");
+	writer.staged = 0;
+}
+
+// Flush and unmap the stage, copy it to the open piece's page and fence the
+// copy, then move on to the next stage in the ring
+void PagedBuffer::flushStage() {
+	if (!writer.mapped)
+		return;
+	Stage& s = stages[next];
+	glBindBuffer(GL_COPY_READ_BUFFER, s.vbo);
+	if (writer.staged)
+		glFlushMappedBufferRange(GL_COPY_READ_BUFFER, 0, writer.staged);
+	writer.mapped = nullptr;
+	if (!glUnmapBuffer(GL_COPY_READ_BUFFER))
+		throw std::runtime_error("staging buffer lost while mapped");
+	if (!writer.staged)
+		return;
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, writer.pieces.back().vbo);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, writer.dest, writer.staged);
+	s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	writer.dest += writer.staged;
+	writer.staged = 0;
+	next = (next + 1) % stages.size();
+}
+
+// Pages left empty become spares, except the one being filled
+void PagedBuffer::free(const std::vector<Piece>& pieces) {
+	for (auto& p : pieces) {
+		Page& page = pages[p.page];
+		page.live -= p.bytes;
+		usedBytes -= p.bytes;
+		if (!page.live && p.page != current)
+			spares.push_back(p.page);
+	}
+}
+
+// Every page becomes a spare
+void PagedBuffer::clear() {
+	flushStage();
+	writer = Writer();
+	spares.clear();
+	for (size_t i = pages.size(); i-- > 0; ) {
+		pages[i].live = 0;
+		spares.push_back(i);
+	}
+	current = pages.size();
+	fill = 0;
+	usedBytes = 0;
+}
+
+// Spares at the front of the list are reused last, so they go first
+void PagedBuffer::trim(uint64_t bytes) {
+	for (size_t i = 0; i < spares.size() && allocated() > bytes; i++) {
+		Page& page = pages[spares[i]];
+		if (page.vbo) {
+			glDeleteBuffers(1, &page.vbo);
+			page.vbo = 0;
+		}
+	}
+}
+
+// Pages with anything in them
+uint64_t PagedBuffer::resident() const {
+	uint64_t ret = 0;
+	for (size_t i = 0; i < pages.size(); i++)
+		if (pages[i].live || i == current)
+			ret += PAGE_SIZE;
+	return ret;
+}
+
+// Pages not deleted
+uint64_t PagedBuffer::allocated() const {
+	uint64_t ret = 0;
+	for (auto& page : pages)
+		if (page.vbo)
+			ret += PAGE_SIZE;
+	return ret;
+}
+
+// Continue in a spare page, creating its buffer again if it was trimmed,
+// or in a new one; the page being left is a spare if nothing is left in it
+void PagedBuffer::nextPage() {
+	if (current < pages.size() && !pages[current].live)
+		spares.push_back(current);
+	if (!spares.empty()) {
+		current = spares.back();
+		spares.pop_back();
+	} else {
+		current = pages.size();
+		pages.push_back({ 0, 0 });
+	}
+	Page& page = pages[current];
+	if (!page.vbo) {
+		glGenBuffers(1, &page.vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, page.vbo);
+		glBufferData(GL_ARRAY_BUFFER, PAGE_SIZE, nullptr, GL_STATIC_DRAW);
+	}
+	fill = 0;
+}
+
+// Delete the page and staging buffers
+void PagedBuffer::release() {
+	for (auto& page : pages)
+		if (page.vbo)
+			glDeleteBuffers(1, &page.vbo);
+	if (writer.mapped) {
+		glBindBuffer(GL_COPY_READ_BUFFER, stages[next].vbo);
+		glUnmapBuffer(GL_COPY_READ_BUFFER);
+	}
+	for (auto& s : stages) {
+		if (s.fence)
+			glDeleteSync(s.fence);
+		glDeleteBuffers(1, &s.vbo);
+	}
+	stages.clear();
+	next = 0;
+	writer = Writer();
+	pages.clear();
+	spares.clear();
+	current = 0;
+	fill = 0;
+	usedBytes = 0;
+}
@@ -0,0 +1,113 @@
+#ifndef PAGES_HPP
+#define PAGES_HPP
+
+#include <vector>
+#include <cstdint>
+#include "gl_core_3_3.h"
+
+// Vertex storage spread over fixed-size pages, each its own buffer object
+// Allocations fill the free space of the current page and continue on the
+// next, so nothing already stored is ever copied or moved. Freed pieces are
+// counted off their pages, and a page with nothing left in it is kept as a
+// spare for later allocations.
+// Data reaches the pages through a ring of staging buffers: each is mapped
+// unsynchronized, filled, flushed and copied into its page on the GPU, and
+// fenced so it is only written again once that copy is done. The host holds
+// no more than what it writes at once, and filling one chunk overlaps with
+// the transfer of the ones before it.
+class PagedBuffer {
+public:
+	static const GLsizeiptr PAGE_SIZE = 1 << 24;	// Bytes per page
+	static const GLsizeiptr STAGE_SIZE = 1 << 20;	// Bytes per staging buffer
+	static const size_t NUM_STAGES = 4;				// Staging buffers in the ring
+
+	// The part of an allocation inside one page
+	struct Piece {
+		GLuint vbo;			// Page buffer
+		size_t page;		// Index of the page
+		GLintptr offset;	// Byte offset in the page
+		uint64_t first;		// Index of its first element in the allocation
+		GLsizei count;		// Number of elements
+		GLsizeiptr bytes;	// Bytes stored
+	};
+
+	PagedBuffer();
+	~PagedBuffer();
+	PagedBuffer(PagedBuffer&& other);
+	PagedBuffer& operator=(PagedBuffer&& other);
+	PagedBuffer(const PagedBuffer&) = delete;
+	PagedBuffer& operator=(const PagedBuffer&) = delete;
+
+	// Store count elements of stride bytes, cutting only after multiples of
+	// unit elements; each piece after the first starts with the last overlap
+	// elements of the piece before it, so strips continue across pages
+	std::vector<Piece> append(const void* data, uint64_t count, GLsizeiptr stride,
+		uint64_t unit, uint64_t overlap);
+	// The same in steps, for data produced a little at a time: begin an
+	// allocation, write elements to it in any number of calls, and end it to
+	// get its pieces; one allocation can be open at a time
+	void begin(GLsizeiptr stride, uint64_t unit, uint64_t overlap);
+	void write(const void* data, uint64_t count);
+	std::vector<Piece> end();
+	// Pieces of the open allocation so far, after copying everything written
+	// to it into the pages, so it can be drawn before it ends
+	const std::vector<Piece>& progress();
+	// Give back the pieces of an allocation
+	void free(const std::vector<Piece>& pieces);
+	// Forget everything stored, the open allocation included, keeping the
+	// pages as spares
+	void clear();
+	// Delete spare pages until at most bytes are allocated, if possible
+	void trim(uint64_t bytes);
+
+	// Bytes stored, bytes of the pages holding them, and bytes of all pages
+	uint64_t used() const {
+		return usedBytes; }
+	uint64_t resident() const;
+	uint64_t allocated() const;
+
+private:
+	// A page buffer and the bytes still in use in it
+	struct Page {
+		GLuint vbo;				// 0 once deleted
+		uint64_t live;			// Bytes of pieces not yet freed
+	};
+
+	// A staging buffer and the fence of the last copy out of it
+	struct Stage {
+		GLuint vbo;
+		GLsync fence;			// 0 once waited for
+	};
+	// The open allocation and where its data is staged
+	struct Writer {
+		GLsizeiptr stride;		// Bytes per element
+		uint64_t unit;			// Pieces end after multiples of this
+		uint64_t overlap;		// Elements repeated at the start of a piece
+		uint64_t written;		// Elements written so far
+		uint64_t room;			// Elements the last piece can still take
+		std::vector<Piece> pieces;	// Pieces so far, the last one open
+		std::vector<unsigned char> tail;	// Last overlap elements written
+		unsigned char* mapped;	// Mapping of the current stage, or null
+		GLsizeiptr staged;		// Bytes in the current stage
+		GLintptr dest;			// Page offset the staged bytes go to
+	};
+
+	void nextPage();			// Move on to a spare or new page
+	void openPiece();			// Start the next piece of the open allocation
+	void closePiece();			// Account for the last piece in its page
+	uint64_t stage(const unsigned char* data, uint64_t count);	// Stage what fits
+	void mapStage();			// Map the current stage once its copy is done
+	void flushStage();			// Copy the current stage into its page
+	void release();				// Delete every page and stage
+
+	std::vector<Page> pages;	// All pages, deleted ones included
+	std::vector<size_t> spares;	// Empty pages, to be filled next
+	size_t current;				// Page being filled, or pages.size()
+	GLsizeiptr fill;			// Bytes used in the current page
+	uint64_t usedBytes;			// Bytes stored in all pages
+	std::vector<Stage> stages;	// Staging ring, created on first use
+	size_t next;				// Stage to write next
+	Writer writer;				// Open allocation
+};
+
+#endif
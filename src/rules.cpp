@@ -0,0 +1,204 @@
+#include "rules.hpp"
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+
+// Inputs shorter than this are not worth splitting across threads
+static const size_t MIN_CHUNK = 1 << 20;
+
+// Empty table: every byte rewrites to itself
+RuleTable::RuleTable() {
+	pool.resize(256);
+	for (unsigned int i = 0; i < 256; i++) {
+		pool[i] = (char)i;
+		table[i] = { i, 1 };
+		ruled[i] = false;
+	}
+	pool.append(32, '\0');
+}
+
+// Compile a rule map into the table
+RuleTable::RuleTable(const std::map<char, std::string>& rules) : RuleTable() {
+	for (auto& r : rules) {
+		unsigned char ch = (unsigned char)r.first;
+		table[ch] = { (uint32_t)pool.size(), (uint32_t)r.second.size() };
+		ruled[ch] = true;
+		pool += r.second;
+	}
+	pool.append(32, '\0');
+}
+
+// Apply rules to a given string and return the result
+std::string RuleTable::apply(const std::string& string) const {
+	std::string ret(outputLength(string.data(), string.size()), '\0');
+	apply(string.data(), string.size(), &ret[0], ret.size());
+	return ret;
+}
+
+// Compose with another table: the image of each symbol is its image under
+// these rules rewritten by next
+RuleTable RuleTable::then(const RuleTable& next) const {
+	RuleTable ret;
+	ret.pool.resize(256);
+	for (unsigned int ch = 0; ch < 256; ch++) {
+		if (!ruled[ch] && !next.ruled[ch])
+			continue;
+		const Entry& e = table[ch];
+		size_t len = next.outputLength(pool.data() + e.offset, e.length);
+		if (ret.pool.size() + len > UINT32_MAX)
+			throw std::length_error("composed rules are too long");
+
+		size_t offset = ret.pool.size();
+		ret.pool.resize(offset + len);
+		next.apply(pool.data() + e.offset, e.length, &ret.pool[offset], len);
+		ret.table[ch] = { (uint32_t)offset, (uint32_t)len };
+		ret.ruled[ch] = true;
+	}
+	ret.pool.append(32, '\0');
+	return ret;
+}
+
+// Exponentiation by squaring; powers of one table commute, so the order in
+// which they are composed does not matter
+RuleTable RuleTable::power(unsigned int n) const {
+	RuleTable ret;
+	RuleTable base = *this;
+	while (n) {
+		if (n & 1)
+			ret = ret.then(base);
+		n >>= 1;
+		if (n)
+			base = base.then(base);
+	}
+	return ret;
+}
+
+// Check that brackets match up within each rule image
+bool RuleTable::isBalanced() const {
+	for (unsigned int ch = 0; ch < 256; ch++) {
+		if (!ruled[ch])
+			continue;
+		int level = 0;
+		const Entry& e = table[ch];
+		for (uint32_t i = 0; i < e.length && level >= 0; i++) {
+			if (pool[e.offset + i] == '[') level++;
+			else if (pool[e.offset + i] == ']') level--;
+		}
+		if (level != 0)
+			return false;
+	}
+	return true;
+}
+
+// Parallel rewrite: size each chunk, prefix-sum the sizes into output
+// offsets, then let every thread write its chunk in place
+std::string RuleTable::applyParallel(const std::string& string, unsigned int threads) const {
+	size_t len = string.size();
+	size_t chunks = std::min<size_t>(threads, len / MIN_CHUNK);
+	if (chunks <= 1)
+		return apply(string);
+
+	std::vector<size_t> srcOff, dstOff;
+	planChunks(string.data(), len, chunks, srcOff, dstOff);
+	std::string ret(dstOff[chunks], '\0');
+	writeChunks(string.data(), &ret[0], srcOff, dstOff);
+	return ret;
+}
+
+// The same into a buffer the caller sized, so a long string can be
+// rewritten block by block without copying the blocks
+size_t RuleTable::applyParallel(const char* str, size_t len, char* out,
+	unsigned int threads) const {
+
+	size_t chunks = std::min<size_t>(threads, len / MIN_CHUNK);
+	if (chunks <= 1) {
+		size_t outLen = outputLength(str, len);
+		apply(str, len, out, outLen);
+		return outLen;
+	}
+
+	std::vector<size_t> srcOff, dstOff;
+	planChunks(str, len, chunks, srcOff, dstOff);
+	writeChunks(str, out, srcOff, dstOff);
+	return dstOff[chunks];
+}
+
+// Pass 1: output size of each chunk, in parallel, then a prefix sum
+void RuleTable::planChunks(const char* str, size_t len, size_t chunks,
+	std::vector<size_t>& srcOff, std::vector<size_t>& dstOff) const {
+
+	srcOff.resize(chunks + 1);
+	for (size_t c = 0; c <= chunks; c++)
+		srcOff[c] = len * c / chunks;
+
+	dstOff.assign(chunks + 1, 0);
+	std::vector<std::thread> workers;
+	for (size_t c = 0; c < chunks; c++)
+		workers.emplace_back([&, c]() {
+			dstOff[c + 1] = outputLength(str + srcOff[c], srcOff[c + 1] - srcOff[c]);
+		});
+	for (auto& w : workers) w.join();
+
+	for (size_t c = 0; c < chunks; c++)
+		dstOff[c + 1] += dstOff[c];
+}
+
+// Pass 2: each chunk fills its own slice of the shared output
+void RuleTable::writeChunks(const char* str, char* out, const std::vector<size_t>& srcOff,
+	const std::vector<size_t>& dstOff) const {
+
+	std::vector<std::thread> workers;
+	for (size_t c = 0; c + 1 < srcOff.size(); c++)
+		workers.emplace_back([&, c]() {
+			apply(str + srcOff[c], srcOff[c + 1] - srcOff[c],
+				out + dstOff[c], dstOff[c + 1] - dstOff[c]);
+		});
+	for (auto& w : workers) w.join();
+}
+
+// First pass: histogram the input and sum replacement lengths
+size_t RuleTable::outputLength(const char* str, size_t len) const {
+	// Four interleaved histograms avoid stalls on runs of the same symbol
+	size_t hist[4][256] = {};
+	const unsigned char* s = (const unsigned char*)str;
+	size_t i = 0;
+	for (; i + 4 <= len; i += 4) {
+		hist[0][s[i]]++;
+		hist[1][s[i + 1]]++;
+		hist[2][s[i + 2]]++;
+		hist[3][s[i + 3]]++;
+	}
+	for (; i < len; i++)
+		hist[0][s[i]]++;
+
+	size_t total = 0;
+	for (unsigned int ch = 0; ch < 256; ch++)
+		total += (hist[0][ch] + hist[1][ch] + hist[2][ch] + hist[3][ch]) * table[ch].length;
+	return total;
+}
+
+// Second pass: copy each replacement into the preallocated output
+void RuleTable::apply(const char* str, size_t len, char* out, size_t outLen) const {
+	const unsigned char* s = (const unsigned char*)str;
+	const char* p = pool.data();
+	size_t i = 0;
+
+	// Short replacements are copied as one fixed 32-byte block, which is safe
+	// while the output has that much room left (the pool is padded to match)
+	char* safeEnd = (outLen > 32) ? out + outLen - 32 : out;
+	for (; i < len && out < safeEnd; i++) {
+		const Entry& e = table[s[i]];
+		if (e.length <= 32)
+			memcpy(out, p + e.offset, 32);
+		else
+			memcpy(out, p + e.offset, e.length);
+		out += e.length;
+	}
+	for (; i < len; i++) {
+		const Entry& e = table[s[i]];
+		memcpy(out, p + e.offset, e.length);
+		out += e.length;
+	}
+}
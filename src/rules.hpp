@@ -0,0 +1,66 @@
+#ifndef RULES_HPP
+#define RULES_HPP
+
+#include <string>
+#include <map>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Generation rules compiled into a flat per-byte table
+// Every byte maps to an (offset, length) slice of one contiguous replacement
+// pool; bytes without a rule map to a one-byte slice holding themselves
+class RuleTable {
+public:
+	RuleTable();
+	explicit RuleTable(const std::map<char, std::string>& rules);
+
+	// Apply rules to a given string and return the result
+	std::string apply(const std::string& string) const;
+	// Same as apply(), splitting the work across the given number of threads
+	std::string applyParallel(const std::string& string, unsigned int threads) const;
+	// Same as applyParallel() on str[0, len), writing into out, which must
+	// have room for outputLength(); returns the bytes written
+	size_t applyParallel(const char* str, size_t len, char* out, unsigned int threads) const;
+
+	// Exact length of the result of applying rules to str[0, len)
+	size_t outputLength(const char* str, size_t len) const;
+	// Apply rules to str[0, len), writing exactly outLen = outputLength() bytes
+	void apply(const char* str, size_t len, char* out, size_t outLen) const;
+
+	// Rules that apply these rules and then next's rules in a single step
+	RuleTable then(const RuleTable& next) const;
+	// Rules that apply these rules n times in a single step (R^n), composed
+	// by repeated squaring
+	RuleTable power(unsigned int n) const;
+
+	// Whether every rule image pops only turtle states it pushed itself
+	bool isBalanced() const;
+
+	// Per-symbol access
+	bool hasRule(char ch) const {
+		return ruled[(unsigned char)ch]; }
+	size_t length(char ch) const {
+		return table[(unsigned char)ch].length; }
+	const char* image(char ch) const {
+		return pool.data() + table[(unsigned char)ch].offset; }
+
+private:
+	// Split str[0, len) into the given number of chunks and find where each
+	// one's output starts
+	void planChunks(const char* str, size_t len, size_t chunks,
+		std::vector<size_t>& srcOff, std::vector<size_t>& dstOff) const;
+	// Rewrite every planned chunk into its slice of out, one thread each
+	void writeChunks(const char* str, char* out, const std::vector<size_t>& srcOff,
+		const std::vector<size_t>& dstOff) const;
+
+	struct Entry {
+		uint32_t offset;	// Start of replacement in pool
+		uint32_t length;	// Length of replacement
+	};
+	Entry table[256];		// Replacement slice for each byte
+	bool ruled[256];		// Whether each byte has a rule
+	std::string pool;		// All replacements, back to back, plus padding
+};
+
+#endif
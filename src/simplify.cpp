@@ -0,0 +1,225 @@
+#include "simplify.hpp"
+#include <cfloat>
+#include <cstdint>
+#include <algorithm>
+#include <thread>
+#include <cmath>
+#include <glm/gtc/type_precision.hpp>
+
+// Float endpoints closer than 1 / QUANTUM are the same point
+static const double QUANTUM = 1024.0;
+// Fewest segments worth a thread of their own
+static const size_t MIN_CHUNK = 1 << 16;
+
+// Largest coordinate magnitude
+static float magnitude(const glm::vec3& v) {
+	return std::max(std::abs(v.x), std::max(std::abs(v.y), std::abs(v.z)));
+}
+
+// Whether segment (b, c) extends segment (a, b) along its line, up to
+// rounding of the coordinates involved
+static bool extends(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+	glm::vec3 run = b - a;
+	glm::vec3 step = c - b;
+	float len = glm::length(run);
+	if (len == 0.0f || glm::dot(run, step) <= 0.0f)
+		return false;
+	float tol = 4.0f * FLT_EPSILON *
+		std::max(std::max(magnitude(a), magnitude(c)), magnitude(c - a));
+	return glm::length(glm::cross(run, c - a)) <= tol * len;
+}
+
+// Exact test on the lattice
+static bool extends(const glm::ivec2& a, const glm::ivec2& b, const glm::ivec2& c) {
+	int64_t rx = (int64_t)b.x - a.x, ry = (int64_t)b.y - a.y;
+	int64_t sx = (int64_t)c.x - b.x, sy = (int64_t)c.y - b.y;
+	return (rx || ry) && rx * sy == ry * sx && rx * sx + ry * sy > 0;
+}
+
+// Keep the last segment written open, stretching its end while the
+// following segments extend it
+template<typename V>
+static size_t merge(std::vector<V>& verts) {
+	size_t out = 0;
+	for (size_t i = 0; i + 1 < verts.size(); i += 2) {
+		if (out > 0 && verts[i] == verts[out - 1] &&
+			extends(verts[out - 2], verts[out - 1], verts[i + 1])) {
+			verts[out - 1] = verts[i + 1];
+			continue;
+		}
+		verts[out++] = verts[i];
+		verts[out++] = verts[i + 1];
+	}
+	size_t removed = verts.size() - out;
+	verts.resize(out);
+	return removed;
+}
+
+// Float vertices
+size_t mergeCollinear(std::vector<glm::vec3>& verts) {
+	return merge(verts);
+}
+
+// Lattice vertices
+size_t mergeCollinear(std::vector<glm::ivec2>& verts) {
+	return merge(verts);
+}
+
+// Integer endpoint on the quantization grid
+static glm::i64vec3 quantize(const glm::vec3& v) {
+	glm::dvec3 q = glm::floor(glm::dvec3(v) * QUANTUM + 0.5);
+	return glm::i64vec3(q);
+}
+static glm::i64vec3 quantize(const glm::ivec2& v) {
+	return glm::i64vec3(v.x, v.y, 0);
+}
+
+// Lexicographic order of grid points
+static bool less(const glm::i64vec3& a, const glm::i64vec3& b) {
+	if (a.x != b.x) return a.x < b.x;
+	if (a.y != b.y) return a.y < b.y;
+	return a.z < b.z;
+}
+
+// Segment endpoints on the grid, smaller first, so both directions match
+template<typename V>
+static void key(const V& a, const V& b, glm::i64vec3& lo, glm::i64vec3& hi) {
+	lo = quantize(a);
+	hi = quantize(b);
+	if (less(hi, lo))
+		std::swap(lo, hi);
+}
+
+// Mix a value into a 64-bit hash
+static uint64_t mix(uint64_t h, uint64_t v) {
+	h ^= v + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+	h ^= h >> 31;
+	h *= 0xBF58476D1CE4E5B9ull;
+	return h ^ (h >> 29);
+}
+
+// Keep the first copy of every segment; each thread owns the segments whose
+// top hash bits select its partition
+template<typename V>
+static size_t dedup(std::vector<V>& verts, unsigned int threads) {
+	size_t segs = verts.size() / 2;
+	size_t parts = std::max<size_t>(1, std::min<size_t>(threads, segs / MIN_CHUNK));
+
+	auto forEach = [&](auto fn) {
+		if (parts == 1) {
+			fn((size_t)0);
+			return;
+		}
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < parts; t++)
+			workers.emplace_back(fn, t);
+		for (auto& w : workers) w.join();
+	};
+
+	// Hash every segment, one chunk per thread
+	std::vector<uint64_t> hashes(segs);
+	forEach([&](size_t t) {
+		glm::i64vec3 lo, hi;
+		for (size_t s = segs * t / parts; s < segs * (t + 1) / parts; s++) {
+			key(verts[2 * s], verts[2 * s + 1], lo, hi);
+			uint64_t h = 0;
+			for (int i = 0; i < 3; i++) {
+				h = mix(h, (uint64_t)lo[i]);
+				h = mix(h, (uint64_t)hi[i]);
+			}
+			hashes[s] = h;
+		}
+	});
+
+	// Each partition marks its repeats in a table of its own, scanning in
+	// order so the first copy is the one kept
+	std::vector<unsigned char> keep(segs, 1);
+	forEach([&](size_t t) {
+		auto part = [&](uint64_t h) {
+			return (size_t)((h >> 32) * parts >> 32); };
+		size_t count = 0;
+		for (size_t s = 0; s < segs; s++)
+			count += part(hashes[s]) == t;
+		size_t cap = 16;
+		while (cap < 2 * count)
+			cap *= 2;
+
+		// Slots hold the hash and segment index + 1, 0 when empty
+		std::vector<std::pair<uint64_t, size_t>> slots(cap, { 0, 0 });
+		glm::i64vec3 lo, hi, lo2, hi2;
+		for (size_t s = 0; s < segs; s++) {
+			uint64_t h = hashes[s];
+			if (part(h) != t)
+				continue;
+			bool keyed = false;
+			for (size_t i = h & (cap - 1); ; i = (i + 1) & (cap - 1)) {
+				if (!slots[i].second) {
+					slots[i] = { h, s + 1 };
+					break;
+				}
+				if (slots[i].first != h)
+					continue;
+				if (!keyed) {
+					key(verts[2 * s], verts[2 * s + 1], lo, hi);
+					keyed = true;
+				}
+				size_t o = slots[i].second - 1;
+				key(verts[2 * o], verts[2 * o + 1], lo2, hi2);
+				if (lo == lo2 && hi == hi2) {
+					keep[s] = 0;
+					break;
+				}
+			}
+		}
+	});
+
+	// Compact the survivors in order
+	size_t out = 0;
+	for (size_t s = 0; s < segs; s++)
+		if (keep[s]) {
+			verts[out++] = verts[2 * s];
+			verts[out++] = verts[2 * s + 1];
+		}
+	size_t removed = verts.size() - out;
+	verts.resize(out);
+	return removed;
+}
+
+// Float vertices
+size_t removeDuplicates(std::vector<glm::vec3>& verts, unsigned int threads) {
+	return dedup(verts, threads);
+}
+
+// Lattice vertices
+size_t removeDuplicates(std::vector<glm::ivec2>& verts, unsigned int threads) {
+	return dedup(verts, threads);
+}
+
+// Append each segment's end to the open strip when it starts at the strip's
+// last vertex, otherwise open a new strip with both its vertices
+template<typename V>
+static size_t strips(std::vector<V>& verts, std::vector<uint64_t>& starts) {
+	starts.clear();
+	size_t out = 0;
+	for (size_t i = 0; i + 1 < verts.size(); i += 2) {
+		if (out == 0 || !(verts[i] == verts[out - 1])) {
+			starts.push_back(out);
+			verts[out++] = verts[i];
+		}
+		verts[out++] = verts[i + 1];
+	}
+	starts.push_back(out);
+	size_t removed = verts.size() - out;
+	verts.resize(out);
+	return removed;
+}
+
+// Float vertices
+size_t joinStrips(std::vector<glm::vec3>& verts, std::vector<uint64_t>& starts) {
+	return strips(verts, starts);
+}
+
+// Lattice vertices
+size_t joinStrips(std::vector<glm::ivec2>& verts, std::vector<uint64_t>& starts) {
+	return strips(verts, starts);
+}
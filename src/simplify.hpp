@@ -0,0 +1,37 @@
+#ifndef SIMPLIFY_HPP
+#define SIMPLIFY_HPP
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Merge runs of contiguous, collinear segments into single segments, in one
+// pass and in place
+// Vertices are pairs as drawn with GL_LINES. A segment joins the one before
+// it when it starts exactly where that one ends, points the same way, and
+// its end lies on the line of the merged segment so far: exactly for lattice
+// vertices, and within float rounding of the coordinates otherwise, so the
+// drawn image does not change. Returns the number of vertices removed.
+size_t mergeCollinear(std::vector<glm::vec3>& verts);
+size_t mergeCollinear(std::vector<glm::ivec2>& verts);
+
+// Drop segments that repeat an earlier one, in either direction, keeping the
+// first copy and the order of the rest
+// Endpoints are quantized (exact for lattice vertices, to a grid much finer than
+// a unit step otherwise) and keyed order-independently in open-addressing hash
+// tables. Threads hash chunks of the segments, then each deduplicates the
+// segments whose hashes fall in its own partition, and the survivors are
+// compacted in order. Returns the number of vertices removed.
+size_t removeDuplicates(std::vector<glm::vec3>& verts, unsigned int threads);
+size_t removeDuplicates(std::vector<glm::ivec2>& verts, unsigned int threads);
+
+// Turn line segment pairs into line strips, in place
+// A segment starting exactly where the one before it ends continues that
+// segment's strip, so each shared vertex is stored once; any other segment,
+// such as the first after a bracket or a move without drawing, starts a new
+// strip. starts receives the first vertex of each strip followed by the
+// total vertex count. Returns the number of vertices removed.
+size_t joinStrips(std::vector<glm::vec3>& verts, std::vector<uint64_t>& starts);
+size_t joinStrips(std::vector<glm::ivec2>& verts, std::vector<uint64_t>& starts);
+
+#endif
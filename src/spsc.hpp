@@ -0,0 +1,57 @@
+#ifndef SPSC_HPP
+#define SPSC_HPP
+
+#include <vector>
+#include <atomic>
+#include <utility>
+#include <cstddef>
+
+// Fixed-capacity queue from exactly one producer thread to exactly one
+// consumer thread, without locks
+// The producer only advances tail and the consumer only advances head;
+// each publishes its slot with a release store that the other side reads
+// with an acquire load, so an item is fully written before it is seen.
+template <typename T>
+class SpscQueue {
+public:
+	// Room for capacity items, rounded up to a power of two
+	explicit SpscQueue(size_t capacity) :
+		head(0),
+		tail(0) {
+
+		size_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+		slots.resize(size);
+		mask = size - 1;
+	}
+
+	// Move item in; false, leaving item as it was, if the queue is full
+	// (producer only)
+	bool push(T& item) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == slots.size())
+			return false;
+		slots[t & mask] = std::move(item);
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Move the oldest item out; false if the queue is empty (consumer only)
+	bool pop(T& item) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		item = std::move(slots[h & mask]);
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::vector<T> slots;					// Ring of items
+	size_t mask;							// slots.size() - 1
+	alignas(64) std::atomic<size_t> head;	// Next item to pop
+	alignas(64) std::atomic<size_t> tail;	// Next slot to push into
+};
+
+#endif
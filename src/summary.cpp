@@ -0,0 +1,197 @@
+#include "summary.hpp"
+#include "turtle.hpp"
+#include <utility>
+
+// Bounds of P * r for every P with lo <= P <= hi elementwise
+static void boundProduct(const glm::mat3& lo, const glm::mat3& hi, const glm::mat3& r,
+	glm::mat3& outLo, glm::mat3& outHi) {
+	for (int j = 0; j < 3; j++)
+		for (int i = 0; i < 3; i++) {
+			float l = 0.0f, h = 0.0f;
+			for (int k = 0; k < 3; k++) {
+				float a = lo[k][i] * r[j][k];
+				float b = hi[k][i] * r[j][k];
+				l += glm::min(a, b);
+				h += glm::max(a, b);
+			}
+			outLo[j][i] = l;
+			outHi[j][i] = h;
+		}
+}
+
+// Grow a motion's vertex bounds to include [lo, hi]
+static void addBounds(Motion& m, const glm::mat3& lo, const glm::mat3& hi) {
+	if (!m.drawn) {
+		m.lo = lo;
+		m.hi = hi;
+		m.drawn = true;
+		return;
+	}
+	for (int k = 0; k < 3; k++) {
+		m.lo[k] = glm::min(m.lo[k], lo[k]);
+		m.hi[k] = glm::max(m.hi[k], hi[k]);
+	}
+}
+
+// Identity motion: no displacement, no rotation, no vertices
+Motion::Motion() :
+	move(0.0f),
+	turn(1.0f),
+	lo(0.0f),
+	hi(0.0f),
+	drawn(false) {}
+
+// Interval bounds of pos + P * dir
+void Motion::bounds(glm::vec3 pos, glm::vec3 dir, glm::vec3& minBB, glm::vec3& maxBB) const {
+	minBB = pos;
+	maxBB = pos;
+	for (int k = 0; k < 3; k++) {
+		glm::vec3 a = lo[k] * dir[k];
+		glm::vec3 b = hi[k] * dir[k];
+		minBB += glm::min(a, b);
+		maxBB += glm::max(a, b);
+	}
+}
+
+// Empty cache
+SummaryCache::SummaryCache() :
+	angle(0.0f),
+	valid(false) {}
+
+// Cache for the given grammar; motions are computed as they are requested
+SummaryCache::SummaryCache(const std::string& axiom, const RuleTable& rules, float angle) :
+	axiom(axiom),
+	rules(rules),
+	angle(angle),
+	valid(rules.isBalanced()) {
+
+	for (unsigned int ch = 0; ch < 256; ch++)
+		rotations[ch] = Turtle::rotation((char)ch, angle);
+}
+
+// Motion of a symbol after depth more steps, computed on first use
+const Motion& SummaryCache::get(char ch, unsigned int depth) {
+	if (!rules.hasRule(ch))
+		depth = 0;
+	uint64_t key = ((uint64_t)depth << 8) | (unsigned char)ch;
+	auto found = cache.find(key);
+	if (found != cache.end())
+		return found->second;
+
+	Motion m;
+	if (depth == 0) {
+		// A single turtle operation
+		if (Turtle::moves(ch))
+			m.move = glm::mat3(1.0f);
+		m.turn = rotations[(unsigned char)ch];
+		if (Turtle::draws(ch))
+			// Vertices at the start (P = 0) and end (P = I) of the step
+			addBounds(m, glm::mat3(0.0f), glm::mat3(1.0f));
+	} else
+		m = compose(rules.image(ch), rules.length(ch), depth - 1);
+
+	return cache.emplace(key, m).first->second;
+}
+
+// Motion of the whole axiom after N steps
+Motion SummaryCache::iteration(unsigned int iter) {
+	return compose(axiom.data(), axiom.size(), iter);
+}
+
+// Chain the motions of a sequence, saving and restoring state at brackets
+Motion SummaryCache::compose(const char* str, size_t len, unsigned int depth) {
+	Motion ret;
+	std::vector<std::pair<glm::mat3, glm::mat3>> stack;
+	for (size_t i = 0; i < len; i++) {
+		char ch = str[i];
+		if (ch == '[') {
+			stack.emplace_back(ret.move, ret.turn);
+			continue;
+		}
+		if (ch == ']') {
+			if (!stack.empty()) {
+				ret.move = stack.back().first;
+				ret.turn = stack.back().second;
+				stack.pop_back();
+			}
+			continue;
+		}
+
+		// The child's vertices P become move + P * turn in this frame
+		const Motion& m = get(ch, depth);
+		if (m.drawn) {
+			glm::mat3 lo, hi;
+			boundProduct(m.lo, m.hi, ret.turn, lo, hi);
+			addBounds(ret, lo + ret.move, hi + ret.move);
+		}
+		ret.move += m.move * ret.turn;
+		ret.turn = m.turn * ret.turn;
+	}
+	return ret;
+}
+
+// Exact bounding box by branch and bound over the derivation
+bool SummaryCache::bounds(unsigned int iter, glm::vec3& minBB, glm::vec3& maxBB) {
+	glm::vec3 pos(0.0f, 0.0f, 0.0f);
+	glm::vec3 dir(0.0f, 1.0f, 0.0f);
+	std::vector<std::pair<glm::vec3, glm::vec3>> stack;
+	bool found = false;
+	for (char ch : axiom) {
+		if (ch == '[')
+			stack.emplace_back(pos, dir);
+		else if (ch == ']') {
+			if (!stack.empty()) {
+				pos = stack.back().first;
+				dir = stack.back().second;
+				stack.pop_back();
+			}
+		} else
+			search(ch, iter, pos, dir, minBB, maxBB, found);
+	}
+	return found;
+}
+
+// Add the vertices below a symbol to the box, skipping it if its cached bounds
+// are already inside; advances pos and dir past the symbol either way
+void SummaryCache::search(char ch, unsigned int depth, glm::vec3& pos, glm::vec3& dir,
+	glm::vec3& minBB, glm::vec3& maxBB, bool& found) {
+
+	const Motion& m = get(ch, depth);
+	if (m.drawn) {
+		glm::vec3 lo, hi;
+		m.bounds(pos, dir, lo, hi);
+		bool inside = found &&
+			glm::all(glm::greaterThanEqual(lo, minBB)) &&
+			glm::all(glm::lessThanEqual(hi, maxBB));
+
+		if (!inside && (depth == 0 || !rules.hasRule(ch))) {
+			// A drawn segment: its endpoints are exact
+			glm::vec3 end = pos + dir;
+			if (!found) {
+				minBB = maxBB = pos;
+				found = true;
+			}
+			minBB = glm::min(glm::min(minBB, pos), end);
+			maxBB = glm::max(glm::max(maxBB, pos), end);
+
+		} else if (!inside) {
+			// Might extend the box: look at the children
+			std::vector<std::pair<glm::vec3, glm::vec3>> stack;
+			const char* img = rules.image(ch);
+			for (size_t i = 0; i < rules.length(ch); i++) {
+				if (img[i] == '[')
+					stack.emplace_back(pos, dir);
+				else if (img[i] == ']') {
+					pos = stack.back().first;
+					dir = stack.back().second;
+					stack.pop_back();
+				} else
+					search(img[i], depth - 1, pos, dir, minBB, maxBB, found);
+			}
+			return;
+		}
+	}
+
+	pos += m.move * dir;
+	dir = m.turn * dir;
+}
@@ -0,0 +1,62 @@
+#ifndef SUMMARY_HPP
+#define SUMMARY_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <glm/glm.hpp>
+#include "rules.hpp"
+
+// Net effect of a bracket-balanced symbol sequence on the turtle
+// Every turtle operator is linear in the heading, so starting from position p
+// with heading d the sequence ends at p + move * d heading turn * d, and
+// each vertex it emits is p + P * d for some matrix P
+struct Motion {
+	glm::mat3 move;		// Displacement as a function of the heading
+	glm::mat3 turn;		// Final heading as a function of the heading
+	glm::mat3 lo;		// Elementwise lower bound of all vertex matrices P
+	glm::mat3 hi;		// Elementwise upper bound of all vertex matrices P
+	bool drawn;			// Whether any vertex is emitted (bounds are valid)
+
+	Motion();
+	// Conservative bounding box of the vertices, given a start state
+	void bounds(glm::vec3 pos, glm::vec3 dir, glm::vec3& minBB, glm::vec3& maxBB) const;
+};
+
+// Per-(symbol, depth) cache of turtle motions, used to find the bounding box
+// and end state of an iteration without generating its vertices
+class SummaryCache {
+public:
+	SummaryCache();
+	SummaryCache(const std::string& axiom, const RuleTable& rules, float angle);
+
+	// Whether every rule is bracket-balanced, which summaries require
+	bool isValid() const {
+		return valid; }
+
+	// Motion of the expansion of a symbol after depth more steps
+	const Motion& get(char ch, unsigned int depth);
+	// Motion of the whole of iteration N
+	Motion iteration(unsigned int iter);
+
+	// Exact bounding box of the vertices of iteration N; subtrees whose cached
+	// bounds fall inside the box found so far are skipped without descending
+	// Returns false if the iteration draws nothing
+	bool bounds(unsigned int iter, glm::vec3& minBB, glm::vec3& maxBB);
+
+private:
+	// Walk a symbol sequence, composing the motions of its symbols
+	Motion compose(const char* str, size_t len, unsigned int depth);
+	// Bounding box search below a symbol
+	void search(char ch, unsigned int depth, glm::vec3& pos, glm::vec3& dir,
+		glm::vec3& minBB, glm::vec3& maxBB, bool& found);
+
+	std::string axiom;							// Iteration 0
+	RuleTable rules;							// Rules applied at every step
+	float angle;								// Angle for rotations
+	glm::mat3 rotations[256];					// Heading rotation of each symbol
+	bool valid;									// All rules are balanced
+	std::unordered_map<uint64_t, Motion> cache;	// (symbol, depth) -> motion
+};
+
+#endif
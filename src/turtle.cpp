@@ -0,0 +1,200 @@
+#include "turtle.hpp"
+#include <algorithm>
+#include <thread>
+#include <stdexcept>
+#include <glm/gtx/transform.hpp>
+
+// Most saved states reserved up front
+static const uint64_t MAX_RESERVE = 1 << 20;
+// Strings shorter than this are not worth splitting across threads
+static const size_t MIN_CHUNK = 1 << 20;
+
+// Classify every symbol and precompute its rotation
+Turtle::Table::Table(float angle) {
+	for (unsigned int ch = 0; ch < 256; ch++) {
+		char c = (char)ch;
+		if (draws(c))
+			ops[ch] = DRAW;
+		else if (moves(c))
+			ops[ch] = MOVE;
+		else if (c == '[')
+			ops[ch] = PUSH;
+		else if (c == ']')
+			ops[ch] = POP;
+		else if (c == '+' || c == '-' || c == '&' || c == '^' ||
+			c == '\\' || c == '/' || c == '|')
+			ops[ch] = TURN;
+		else
+			ops[ch] = NONE;
+		rotations[ch] = rotation(c, angle);
+	}
+}
+
+// Start at the origin heading along +y
+Turtle::Turtle(const Table& table) :
+	table(table),
+	state{ glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f) } {}
+
+// Reserve room for depth saved states, up to MAX_RESERVE (deeper stacks
+// still grow as needed), and for every vertex to come
+void Turtle::reserve(uint64_t depth, uint64_t segments) {
+	stack.reserve((size_t)std::min<uint64_t>(depth, MAX_RESERVE));
+	verts.reserve((size_t)(2 * segments));
+}
+
+// The interpreter loop shared by feed() and feedParallel()
+template <typename Emit>
+void Turtle::run(const char* str, size_t len, State& state,
+	std::vector<State>& stack, Emit emit) const {
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char ch = str[i];
+		switch (table.ops[ch]) {
+		case Table::DRAW:
+			emit(state.pos);
+			state.pos += state.dir;
+			emit(state.pos);
+			break;
+		case Table::MOVE:
+			state.pos += state.dir;
+			break;
+		case Table::TURN:
+			state.dir = table.rotations[ch] * state.dir;
+			break;
+		case Table::PUSH:
+			stack.push_back(state);
+			break;
+		case Table::POP:
+			state = stack.back();
+			stack.pop_back();
+			break;
+		case Table::NONE:
+			break;
+		}
+	}
+}
+
+// Interpret a block of symbols, appending drawn segments to verts
+void Turtle::feed(const char* str, size_t len) {
+	run(str, len, state, stack, [this](const glm::vec3& v) {
+		verts.push_back(v);
+	});
+}
+
+// Three passes: summarize each chunk as a transform of its unknown start
+// state, resolve every chunk's start state in order, then let each chunk
+// write its vertices at its offset in the output
+void Turtle::feedParallel(const char* str, size_t len, unsigned int threads) {
+	size_t chunks = std::min<size_t>(threads, len / MIN_CHUNK);
+	if (chunks <= 1) {
+		feed(str, len);
+		return;
+	}
+
+	std::vector<size_t> srcOff(chunks + 1);
+	for (size_t c = 0; c <= chunks; c++)
+		srcOff[c] = len * c / chunks;
+
+	// Pass 1: what each chunk does relative to its start
+	std::vector<Chunk> summaries(chunks);
+	std::vector<std::thread> workers;
+	for (size_t c = 0; c < chunks; c++)
+		workers.emplace_back([&, c]() {
+			summaries[c] = summarize(str + srcOff[c], srcOff[c + 1] - srcOff[c]);
+		});
+	for (auto& w : workers) w.join();
+	workers.clear();
+
+	// Pass 2: walk the summaries with the real stack to find the state each
+	// chunk starts in and the states it pops; also gives vertex offsets
+	std::vector<State> starts(chunks);
+	std::vector<std::vector<State>> popped(chunks);
+	std::vector<size_t> dstOff(chunks + 1, verts.size());
+	for (size_t c = 0; c < chunks; c++) {
+		const Chunk& sum = summaries[c];
+		starts[c] = state;
+		State base = state;
+		for (size_t i = 0; i < sum.pops; i++) {
+			if (stack.empty())
+				throw std::runtime_error("unbalanced brackets");
+			base = stack.back();
+			stack.pop_back();
+			popped[c].push_back(base);
+		}
+		for (auto& p : sum.pushes)
+			stack.push_back({ base.pos + p.first * base.dir, p.second * base.dir });
+		state = { base.pos + sum.move * base.dir, sum.turn * base.dir };
+		dstOff[c + 1] = dstOff[c] + 2 * sum.segments;
+	}
+
+	// Pass 3: replay each chunk from its start, with the states it pops
+	// preloaded, straight into its slice of verts
+	verts.resize(dstOff[chunks]);
+	glm::vec3* out = verts.data();
+	for (size_t c = 0; c < chunks; c++)
+		workers.emplace_back([&, c]() {
+			State s = starts[c];
+			std::vector<State> st(popped[c].rbegin(), popped[c].rend());
+			glm::vec3* o = out + dstOff[c];
+			run(str + srcOff[c], srcOff[c + 1] - srcOff[c], s, st,
+				[&o](const glm::vec3& v) { *o++ = v; });
+		});
+	for (auto& w : workers) w.join();
+}
+
+// Compose the chunk's moves and turns as matrices acting on the start
+// heading; every operator is linear in it
+Turtle::Chunk Turtle::summarize(const char* str, size_t len) const {
+	Chunk ret{ 0, glm::mat3(0.0f), glm::mat3(1.0f), {}, 0 };
+	for (size_t i = 0; i < len; i++) {
+		unsigned char ch = str[i];
+		switch (table.ops[ch]) {
+		case Table::DRAW:
+			ret.segments++;
+			ret.move += ret.turn;
+			break;
+		case Table::MOVE:
+			ret.move += ret.turn;
+			break;
+		case Table::TURN:
+			ret.turn = table.rotations[ch] * ret.turn;
+			break;
+		case Table::PUSH:
+			ret.pushes.emplace_back(ret.move, ret.turn);
+			break;
+		case Table::POP:
+			if (ret.pushes.empty()) {
+				// Pops a state from before the chunk, which becomes the base
+				ret.pops++;
+				ret.move = glm::mat3(0.0f);
+				ret.turn = glm::mat3(1.0f);
+			} else {
+				ret.move = ret.pushes.back().first;
+				ret.turn = ret.pushes.back().second;
+				ret.pushes.pop_back();
+			}
+			break;
+		case Table::NONE:
+			break;
+		}
+	}
+	return ret;
+}
+
+// Rotation of the heading by a symbol
+glm::mat3 Turtle::rotation(char ch, float angle) {
+	switch (ch) {
+	case '+':	return glm::mat3(glm::rotate(glm::radians(angle), glm::vec3(1.0,0.0,0.0)));
+	case '-':	return glm::mat3(glm::rotate(glm::radians(-angle), glm::vec3(1.0,0.0,0.0)));
+	case '&':	return glm::mat3(glm::rotate(glm::radians(angle), glm::vec3(0.0,1.0,0.0)));
+	case '^':	return glm::mat3(glm::rotate(glm::radians(-angle), glm::vec3(0.0,1.0,0.0)));
+	case '\\':	return glm::mat3(glm::rotate(glm::radians(angle), glm::vec3(0.0,0.0,1.0)));
+	case '/':	return glm::mat3(glm::rotate(glm::radians(-angle), glm::vec3(0.0,0.0,1.0)));
+	case '|': {
+		glm::mat3 ru = glm::mat4(1.0f);
+		ru[0] = glm::vec3(cos(glm::radians(180.0)), sin(glm::radians(180.0)), 0.0f);
+		ru[1] = glm::vec3(-sin(glm::radians(180.0)), cos(glm::radians(180.0)), 0.0f);
+		return ru; }
+	default:	return glm::mat3(1.0f);
+	}
+}
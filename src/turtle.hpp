@@ -0,0 +1,87 @@
+#ifndef TURTLE_HPP
+#define TURTLE_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Turtle interpreter that turns L-system symbols into line segments
+// Symbols can be fed in any number of blocks; state carries across blocks
+class Turtle {
+public:
+	// What each symbol does, and the heading rotations for one angle, built
+	// once and shared by every turtle using that angle
+	struct Table {
+		enum Op : unsigned char {
+			NONE,		// Ignored
+			DRAW,		// Move forward, drawing a segment
+			MOVE,		// Move forward without drawing
+			TURN,		// Rotate the heading
+			PUSH,		// Save state
+			POP			// Restore state
+		};
+		Op ops[256];				// Opcode of each symbol
+		glm::mat3 rotations[256];	// Heading rotation of each TURN symbol
+
+		Table(float angle = 0.0f);
+	};
+
+	Turtle(const Table& table);
+
+	// Preallocate the state stack for the given bracket nesting and the
+	// vertices for the given number of segments
+	void reserve(uint64_t depth, uint64_t segments);
+
+	// Interpret a block of symbols
+	void feed(const char* str, size_t len);
+	void feed(const std::string& string) {
+		feed(string.data(), string.size()); }
+	// Same as feed(), splitting the symbols across the given number of threads
+	// Matches feed() within float tolerance
+	void feedParallel(const char* str, size_t len, unsigned int threads);
+	void feedParallel(const std::string& string, unsigned int threads) {
+		feedParallel(string.data(), string.size(), threads); }
+
+	// Geometry generated so far, every two vertices making a line segment
+	std::vector<glm::vec3> verts;
+
+	// Symbol classes
+	static bool draws(char ch) {
+		return ch == 'f' || ch == 'F' || ch == 'g' || ch == 'G'; }
+	static bool moves(char ch) {
+		return draws(ch) || ch == 's' || ch == 'S'; }
+	// Rotation applied to the heading by a symbol (identity if it has none)
+	static glm::mat3 rotation(char ch, float angle);
+
+private:
+	// Everything a bracket saves; rotations are about the world axes, so the
+	// heading alone is the turtle's orientation
+	struct State {
+		glm::vec3 pos;				// Position
+		glm::vec3 dir;				// Heading
+	};
+
+	// Effect of a chunk of symbols on a turtle whose state is not known yet
+	// States are relative to the chunk's base: the state it starts in, or the
+	// last state it pops that was pushed before the chunk began
+	struct Chunk {
+		size_t pops;				// States popped from before the chunk
+		glm::mat3 move;				// Final position is base + move * dir
+		glm::mat3 turn;				// Final heading is turn * dir
+		std::vector<std::pair<glm::mat3, glm::mat3>> pushes;	// Left pushed
+		uint64_t segments;			// Segments drawn
+	};
+	Chunk summarize(const char* str, size_t len) const;
+
+	// Interpret symbols from the given state, handing each vertex to emit
+	template <typename Emit>
+	void run(const char* str, size_t len, State& state,
+		std::vector<State>& stack, Emit emit) const;
+
+	const Table& table;				// Opcodes and rotations
+	State state;					// Current state
+	std::vector<State> stack;		// Saved states, innermost last
+};
+
+#endif